@@ -0,0 +1,143 @@
+// allocation benchmarks: small Lox programs that mostly create objects.
+// build and run with `make bench_alloc && ./bench_alloc`
+// (with the DEBUG_ flags in common.h turned off, or it's mostly printing)
+#include <stdio.h>
+#include <time.h>
+
+#include "../vm.h"
+
+// the objects as they were laid out with the old 16-byte header
+// (an `ObjType`, the flags and an intrusive `next` pointer),
+// to see what the 4-byte one saves
+typedef struct {
+    ObjType type;
+    bool isMarked;
+    bool isOld;
+    bool isRemembered;
+    bool isForwarded;
+    Obj* next;
+} WideObj;
+
+typedef struct { WideObj obj; Value* location; Value closed; void* next; } WideUpvalue;
+typedef struct { WideObj obj; int length; bool isInterned; uint32_t hash;
+                 char* chars; void* left; void* right; } WideString;
+typedef struct { WideObj obj; NativeFn function; } WideNative;
+typedef struct { WideObj obj; int arity; int upvalueCount; Chunk chunk; ObjString* name; } WideFunction;
+typedef struct { WideObj obj; ObjFunction* function; ObjUpvalue** upvalues; int upvalueCount; } WideClosure;
+typedef struct { WideObj obj; ObjString* name; Table methods; } WideClass;
+typedef struct { WideObj obj; ObjClass* klass; Table fields; } WideInstance;
+typedef struct { WideObj obj; Value receiver; ObjClosure* method; } WideBoundMethod;
+typedef struct { WideObj obj; Value target; } WideWeakRef;
+typedef struct { WideObj obj; bool weakKeys; bool weakValues; int count; int tombstones;
+                 int capacity; WeakEntry* entries; } WideWeakTable;
+
+typedef struct {
+    const char* name;
+    size_t size;
+    size_t wideSize;
+} TypeLayout;
+
+// in `ObjType` order
+static const TypeLayout layouts[OBJ_TYPE_COUNT] = {
+    {"upvalue", sizeof(ObjUpvalue), sizeof(WideUpvalue)},
+    {"string", sizeof(ObjString), sizeof(WideString)},
+    {"native", sizeof(ObjNative), sizeof(WideNative)},
+    {"function", sizeof(ObjFunction), sizeof(WideFunction)},
+    {"closure", sizeof(ObjClosure), sizeof(WideClosure)},
+    {"class", sizeof(ObjClass), sizeof(WideClass)},
+    {"instance", sizeof(ObjInstance), sizeof(WideInstance)},
+    {"bound method", sizeof(ObjBoundMethod), sizeof(WideBoundMethod)},
+    {"weak ref", sizeof(ObjWeakRef), sizeof(WideWeakRef)},
+    {"weak table", sizeof(ObjWeakTable), sizeof(WideWeakTable)},
+};
+
+// objects get cells (or nursery space) in multiples of 8 bytes
+#define CELL_BYTES(size) (((size) + 7) & ~(size_t) 7)
+
+typedef struct {
+    const char* name;
+    const char* source;
+} Benchmark;
+
+static const Benchmark benchmarks[] = {
+    // nearly everything dies young
+    {"short-lived instances",
+     "class P { init(x, y) { this.x = x; this.y = y; } }\n"
+     "var sum = 0;\n"
+     "for(var i = 0; i < 2000000; i = i + 1) { var p = P(i, i); sum = sum + p.x; }\n"
+     "print sum;\n"},
+    // everything survives, so it all ends up promoted into the old generation
+    {"long-lived list",
+     "class Node { init(v, next) { this.v = v; this.next = next; } }\n"
+     "var head = nil;\n"
+     "for(var i = 0; i < 500000; i = i + 1) head = Node(i, head);\n"
+     "var n = 0; while(head != nil) { n = n + 1; head = head.next; }\n"
+     "print n;\n"},
+    // lots of small character buffers and tables
+    {"short strings",
+     "var s = \"\";\n"
+     "for(var i = 0; i < 1000000; i = i + 1) { s = \"ab\" + \"cd\"; s = s + \"ef\"; }\n"
+     "print s;\n"},
+    {"closures",
+     "fun counter() { var n = 0; fun inc() { n = n + 1; return n; } return inc; }\n"
+     "var total = 0;\n"
+     "for(var i = 0; i < 1000000; i = i + 1) { var c = counter(); total = total + c(); }\n"
+     "print total;\n"},
+    // a function that captures nothing, declared over and over
+    {"local functions",
+     "var total = 0;\n"
+     "for(var i = 0; i < 1000000; i = i + 1) { fun square(x) { return x * x; } total = total + square(i); }\n"
+     "print total;\n"},
+    // a closure capturing the first local while the 32 after it are already captured
+    {"open upvalues",
+     "fun many() {\n"
+     "  var first = 0;\n"
+     "  var a0 = 0; var a1 = 1; var a2 = 2; var a3 = 3; var a4 = 4; var a5 = 5; var a6 = 6; var a7 = 7;\n"
+     "  var b0 = 0; var b1 = 1; var b2 = 2; var b3 = 3; var b4 = 4; var b5 = 5; var b6 = 6; var b7 = 7;\n"
+     "  var c0 = 0; var c1 = 1; var c2 = 2; var c3 = 3; var c4 = 4; var c5 = 5; var c6 = 6; var c7 = 7;\n"
+     "  var d0 = 0; var d1 = 1; var d2 = 2; var d3 = 3; var d4 = 4; var d5 = 5; var d6 = 6; var d7 = 7;\n"
+     "  fun all() { return a0 + a1 + a2 + a3 + a4 + a5 + a6 + a7 + b0 + b1 + b2 + b3 + b4 + b5 + b6 + b7\n"
+     "                + c0 + c1 + c2 + c3 + c4 + c5 + c6 + c7 + d0 + d1 + d2 + d3 + d4 + d5 + d6 + d7; }\n"
+     "  var total = 0;\n"
+     "  for(var i = 0; i < 1000000; i = i + 1) { fun f() { return first; } total = total + f(); first = first + 1; }\n"
+     "  return total + all();\n"
+     "}\n"
+     "print many();\n"},
+    // only `var f = a.add` makes a bound method: `(a.add)(2)` is an OP_GET_METHOD, `a.add(3)` an OP_INVOKE
+    {"bound methods",
+     "class A { init() { this.n = 0; } add(k) { this.n = this.n + k; } }\n"
+     "var a = A();\n"
+     "for(var i = 0; i < 1000000; i = i + 1) { var f = a.add; f(1); (a.add)(2); a.add(3); }\n"
+     "print a.n;\n"},
+};
+
+int main() {
+    size_t objects[OBJ_TYPE_COUNT] = {0};
+    int count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    for(int i = 0; i < count; i++) {
+        initVM();
+        clock_t start = clock();
+        interpret(benchmarks[i].source);
+        double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+        for(int type = 0; type < OBJ_TYPE_COUNT; type++)
+            objects[type] += vm.objectsAllocated[type];
+        freeVM();
+        printf("%-22s %8.3fs\n", benchmarks[i].name, seconds);
+    } 
+
+    // everything allocated over all of the benchmarks
+    printf("\n%-14s %10s %6s %14s %14s\n", "type", "objects", "size", "bytes", "saved");
+    size_t totalBytes = 0, totalSaved = 0;
+    for(int type = 0; type < OBJ_TYPE_COUNT; type++) {
+        const TypeLayout* layout = &layouts[type];
+        size_t bytes = objects[type] * CELL_BYTES(layout->size);
+        size_t saved = objects[type] * (CELL_BYTES(layout->wideSize) - CELL_BYTES(layout->size));
+        printf("%-14s %10zu %3zu/%-2zu %14zu %14zu\n", layout->name, objects[type],
+               CELL_BYTES(layout->size), CELL_BYTES(layout->wideSize), bytes, saved);
+        totalBytes += bytes;
+        totalSaved += saved;
+    } 
+    printf("%-14s %10s %6s %14zu %14zu (%.1f%%)\n", "total", "", "", totalBytes, totalSaved,
+           100.0 * totalSaved / (totalBytes + totalSaved));
+    return 0;
+} 
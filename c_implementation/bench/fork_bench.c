@@ -0,0 +1,74 @@
+// freezing: a parent loads a big heap, then forks a worker that runs a script
+// allocating enough to go through a major collection. the worker reports how much of
+// what it shared with the parent it ended up copying, and how long it spent collecting,
+// with and without `freezeHeap` before the fork.
+// build and run with `make bench_fork && ./bench_fork` (Linux only: it reads /proc)
+// (with the DEBUG_ flags in common.h turned off, or it's mostly printing)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../vm.h"
+
+// what the parent loads before forking: a table-heavy structure that outlives every worker
+static const char* setup =
+    "class Entry { init(key, value, next) { this.key = key; this.value = value; this.next = next; } }\n"
+    "var data = nil;\n"
+    "for(var i = 0; i < 200000; i = i + 1) data = Entry(i, \"value\" + \"s\", data);\n";
+
+// what a worker does: plenty of garbage, and a little that's kept
+static const char* work =
+    "class Node { init(v, next) { this.v = v; this.next = next; } }\n"
+    "var kept = nil;\n"
+    "for(var round = 0; round < 400; round = round + 1) {\n"
+    "    var tmp = nil;\n"
+    "    for(var i = 0; i < 5000; i = i + 1) tmp = Node(i, tmp);\n"
+    "    kept = Node(round, kept);\n"
+    "}\n";
+
+// in kilobytes, from the kernel's totals for this process
+static long smapsField(const char* name) {
+    FILE* file = fopen("/proc/self/smaps_rollup", "r");
+    if(file == NULL) return -1;
+    char line[256];
+    long total = 0;
+    size_t length = strlen(name);
+    while(fgets(line, sizeof(line), file) != NULL) {
+        if(strncmp(line, name, length) == 0) total += atol(line + length);
+    }
+    fclose(file);
+    return total;
+}
+
+static void run(const char* name, bool freeze) {
+    initVM();
+    interpret(setup);
+    if(freeze) freezeHeap();
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if(pid == 0) {
+        // only the worker's own collections
+        vm.gcPauses = 0;
+        vm.gcPauseTotal = vm.gcPauseMax = 0;
+        long shared = smapsField("Shared_Dirty:");
+        interpret(work);
+        long unshared = shared - smapsField("Shared_Dirty:");
+        printf("%-10s worker: %6ld KB shared at the fork, %6ld KB of it copied (%4.1f%%), "
+               "%4d gc pauses taking %7.2f ms (longest %6.2f ms)\n",
+               name, shared, unshared, shared > 0 ? unshared * 100.0 / shared : 0.0,
+               vm.gcPauses, vm.gcPauseTotal * 1000, vm.gcPauseMax * 1000);
+        fflush(stdout);
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    freeVM();
+}
+
+int main() {
+    run("unfrozen", false);
+    run("frozen", true);
+    return 0;
+}
@@ -0,0 +1,86 @@
+// microbenchmark for `hashString`, against the FNV-1a hash it replaced.
+// build and run with `make bench_hash && ./bench_hash`
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../hash.h"
+
+#define IDENTIFIER_COUNT 4096
+#define IDENTIFIER_ROUNDS 2000
+#define PAYLOAD_LENGTH (64 * 1024)
+#define PAYLOAD_ROUNDS 20000
+
+// the old byte-at-a-time hash, for comparison
+static uint32_t fnv1a(const char* key, int length) {
+	uint32_t hash = 2166136261u;
+	for(int i = 0; i < length; i++) {
+		hash ^= (uint8_t) key[i];
+		hash *= 16777619;
+	} 
+	return hash;
+} 
+
+typedef uint32_t (*HashFn)(const char* key, int length);
+
+// keeps the compiler from throwing the hashes away
+static volatile uint32_t sink;
+
+static double secondsSince(clock_t start) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+} 
+
+static void benchIdentifiers(const char* name, HashFn hash,
+                             char identifiers[][16], int* lengths) {
+    long bytes = 0;
+    clock_t start = clock();
+    for(int round = 0; round < IDENTIFIER_ROUNDS; round++) {
+        for(int i = 0; i < IDENTIFIER_COUNT; i++) {
+            sink ^= hash(identifiers[i], lengths[i]);
+            bytes += lengths[i];
+        } 
+    } 
+    double seconds = secondsSince(start);
+    long calls = (long) IDENTIFIER_COUNT * IDENTIFIER_ROUNDS;
+    printf("  %-8s identifiers: %6.2f ns/hash  %8.1f MB/s\n", name,
+           seconds * 1e9 / calls, bytes / seconds / 1e6);
+} 
+
+static void benchPayload(const char* name, HashFn hash, const char* payload) {
+    clock_t start = clock();
+    for(int round = 0; round < PAYLOAD_ROUNDS; round++)
+        sink ^= hash(payload, PAYLOAD_LENGTH);
+    double seconds = secondsSince(start);
+    double bytes = (double) PAYLOAD_LENGTH * PAYLOAD_ROUNDS;
+    printf("  %-8s 64 KB payload: %6.3f ns/byte %8.1f MB/s\n", name,
+           seconds * 1e9 / bytes, bytes / seconds / 1e6);
+} 
+
+int main() {
+    seedHash(randomHashSeed());
+    srand(1);
+
+    // short identifier-like keys, 3 to 15 characters
+    static char identifiers[IDENTIFIER_COUNT][16];
+    static int lengths[IDENTIFIER_COUNT];
+    for(int i = 0; i < IDENTIFIER_COUNT; i++) {
+        lengths[i] = 3 + rand() % 13;
+        for(int j = 0; j < lengths[i]; j++)
+            identifiers[i][j] = "abcdefghijklmnopqrstuvwxyz_"[rand() % 27];
+    } 
+
+    char* payload = malloc(PAYLOAD_LENGTH);
+    if(payload == NULL) return 1;
+    for(int i = 0; i < PAYLOAD_LENGTH; i++)
+        payload[i] = (char)(rand() & 0x7F);
+
+    printf("short identifiers:\n");
+    benchIdentifiers("fnv1a", fnv1a, identifiers, lengths);
+    benchIdentifiers("xxhash64", hashString, identifiers, lengths);
+    printf("long payloads:\n");
+    benchPayload("fnv1a", fnv1a, payload);
+    benchPayload("xxhash64", hashString, payload);
+
+    free(payload);
+    return 0;
+} 
@@ -0,0 +1,53 @@
+// request scopes: the same short script run over and over, like one per request,
+// with and without `beginRequestScope`/`endRequestScope` around each run.
+// build and run with `make bench_request && ./bench_request`
+// (with the DEBUG_ flags in common.h turned off, or it's mostly printing)
+#include <stdio.h>
+#include <time.h>
+
+#include "../vm.h"
+
+#define REQUESTS 2000
+
+// set up once, before any request: these globals outlive all of them
+static const char* setup =
+    "class Node { init(v, next) { this.v = v; this.next = next; } }\n"
+    "var served = 0;\n"
+    "var last = nil;\n";
+
+// builds a bit of everything and throws nearly all of it away
+static const char* request =
+    "var list = nil;\n"
+    "for(var i = 0; i < 2000; i = i + 1) list = Node(\"item \" + \"name\", list);\n"
+    "fun sum(n) { var total = 0; while(n != nil) { total = total + 1; n = n.next; } return total; }\n"
+    "served = served + sum(list);\n";
+
+// the same, but the last node is kept around in an older global
+static const char* escaping =
+    "var list = nil;\n"
+    "for(var i = 0; i < 2000; i = i + 1) list = Node(\"item \" + \"name\", list);\n"
+    "fun sum(n) { var total = 0; while(n != nil) { total = total + 1; n = n.next; } return total; }\n"
+    "served = served + sum(list);\n"
+    "last = Node(list.v, nil);\n";
+
+static void run(const char* name, const char* source, bool scoped) {
+    initVM();
+    interpret(setup);
+    clock_t start = clock();
+    for(int i = 0; i < REQUESTS; i++) {
+        if(scoped) beginRequestScope();
+        interpret(source);
+        if(scoped) endRequestScope();
+    }
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("%-22s %8.3fs %6d gc pauses %10zu bytes left over\n",
+           name, seconds, vm.gcPauses, vm.bytesAllocated);
+    freeVM();
+}
+
+int main() {
+    run("unscoped", request, false);
+    run("scoped", request, true);
+    run("scoped, escaping", escaping, true);
+    return 0;
+}
@@ -25,6 +25,7 @@ typedef enum {
     OP_JUMP_IF_FALSE,
     OP_LOOP,
     OP_CALL,
+    OP_CALL_METHOD,
     OP_INVOKE,
     OP_INVOKE_LONG,
     OP_SUPER_INVOKE,
@@ -46,6 +47,7 @@ typedef enum {
 	OP_SET_GLOBAL_LONG,
     OP_GET_PROPERTY,
     OP_GET_PROPERTY_LONG,
+    OP_GET_METHOD,
     OP_SET_PROPERTY,
     OP_SET_PROPERTY_LONG,
     OP_GET_SUPER,
@@ -13,7 +13,10 @@
 
 // stress mode. GC runs as often as possible
 #undef  DEBUG_STRESS_GC
-#define DEBUG_LOG_GC
+#undef  DEBUG_LOG_GC
+
+// mark the old generation on a background thread instead of in slices
+#undef  GC_CONCURRENT
 /***** END FLAGS *****/
 
 #define UINT8_COUNT (UINT8_MAX + 1)
@@ -84,6 +84,10 @@ typedef struct Compiler {
     int currentLoopScope;
     int continueJumpLocation;
     int breakJumpLocation;
+
+    // where the last OP_GET_PROPERTY is, as long as nothing
+    // has been written or jumped to after it (see `call`)
+    int lastGetProperty;
 } Compiler;
 
 // nesting class declarations
@@ -97,6 +101,7 @@ Parser parser;
 Compiler* current = NULL;
 ClassCompiler* currentClass = NULL;
 // Chunk* compilingChunk;
+bool immortalCode = false; // see `codeAllocation`
 
 // current chunk: the one owned by the function we compile
 static Chunk* currentChunk() {
@@ -248,6 +253,19 @@ static void patchJump(int offset) {
 
     currentChunk()->code[offset] = (jump >> 8) & 0xff;
     currentChunk()->code[offset + 1] = jump & 0xff;
+    // the code after the jump can be reached without the property get before it
+    current->lastGetProperty = -1;
+} 
+
+// where the objects the compiler makes next go.
+// the main script's functions, names and constants live until the VM is freed,
+// so the garbage collector doesn't have to keep looking at them (see `runFile`).
+// anything compiled after that is young like everything else, and a request's functions
+// go away with the rest of the request (see `beginRequestScope`). names and constants
+// never go in its arena: the names of its globals are still around after it
+static void codeAllocation(bool functions) {
+    vm.immortalAllocation = immortalCode && !(functions && vm.scopeOpen);
+    vm.youngAllocation = !immortalCode && !functions;
 } 
 
 static void initCompiler(Compiler* compiler, FunctionType type) {
@@ -259,7 +277,9 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
 
+    codeAllocation(true);
     compiler->function = newFunction();
+    codeAllocation(false);
     
     // stuff for break and continue
     compiler->loopDepth = 0;
@@ -267,6 +287,7 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->continueJumpLocation = -1;
     compiler->breakJumpLocation = -1;
     compiler->breakCount = 0;
+    compiler->lastGetProperty = -1;
     current = compiler;
 
     if(type != TYPE_SCRIPT) {
@@ -298,6 +319,14 @@ static ObjFunction* endCompiler() {
     emitReturn();
     ObjFunction* function = current->function;
 
+    // a function that captures nothing gets its one closure now, along with the function
+    // (see `initCompiler`), instead of a new one every time OP_CLOSURE runs
+    if(function->upvalueCount == 0) {
+        codeAllocation(true);
+        function->closure = newClosure(function);
+        codeAllocation(false);
+    } 
+
 #ifdef DEBUG_PRINT_CODE
     // only dump if error-free
     if(!parser.hadError) {
@@ -337,8 +366,9 @@ static void emitPopsForLocals(int scope) {
 } 
 
 static int identifierConstant(Token* name) {
+// these are always used as table keys, so intern long ones now rather than on every lookup
 return addConstant(currentChunk(), 
-    OBJ_VAL(copyString(name->start, name->length)));
+    OBJ_VAL(internString(copyString(name->start, name->length))));
 } 
 
 // must forward define these because they are used recursively
@@ -400,6 +430,17 @@ static uint8_t argumentList() {
 
 // function already on top of stack as a `get` from the local variable
 static void call(bool canAssign) {
+    // a property that's called as soon as it's gotten, like `(a.method)(x)`:
+    // the get turns into an OP_GET_METHOD, which still looks it up before the arguments,
+    // but leaves a method and its receiver on the stack instead of making a bound method
+    int get = current->lastGetProperty;
+    if(get >= 0 && get + 2 == currentChunk()->count) {
+        currentChunk()->code[get] = OP_GET_METHOD;
+        uint8_t argCount = argumentList();
+        emitBytes(OP_CALL_METHOD, argCount);
+        return;
+    } 
+
     // compiles the arguments
     uint8_t argCount = argumentList();
     // invoke function and use argument count as an operand
@@ -407,6 +448,8 @@ static void call(bool canAssign) {
 } 
 
 static void getProperty(int index) {
+    // (the long form keeps its own lookup)
+    current->lastGetProperty = index <= UINT8_MAX ? currentChunk()->count : -1;
     emitByteAndIndex(OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, index);
 } 
 
@@ -526,6 +569,7 @@ static int globalConstant(Token* name, bool modifiable) {
     int newIndex = vm.globalValues.count;
     writeValueArray(&vm.globalValues, UNDEF_VAL);
     tableSet(&vm.globalNames, variable_name, NUMBER_VAL((double) newIndex));
+    if(!isImmortal((Obj*) variable_name)) vm.mortalNames = true;
     pop();
     return newIndex;
     // return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
@@ -1484,6 +1528,9 @@ static void statement() {
 } 
 
 ObjFunction* compile(const char* source) {
+    immortalCode = vm.immortalCode;
+    vm.immortalCode = false;
+    codeAllocation(false);
     initScanner(source);
     Compiler compiler; // same as the "current" field
     initCompiler(&compiler, TYPE_SCRIPT);
@@ -1501,14 +1548,7 @@ ObjFunction* compile(const char* source) {
         declaration();
 
     ObjFunction* function = endCompiler();
+    vm.immortalAllocation = false;
+    vm.youngAllocation = false;
     return parser.hadError ? NULL : function;
 } 
-
-void markCompilerRoots() {
-    Compiler* compiler = current;
-    // the function the compiler is currently compiling
-    while(compiler != NULL) {
-        markObject((Obj*) compiler->function);
-        compiler = compiler->enclosing;
-    } 
-} 
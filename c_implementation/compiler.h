@@ -5,7 +5,6 @@
 #include "object.h"
 
 ObjFunction* compile(const char* source);
-void markCompilerRoots();
 
 Table constantGlobals;
 
@@ -148,6 +148,8 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_CALL_METHOD:
+            return byteInstruction("OP_CALL_METHOD", chunk, offset);
         case OP_INVOKE:
             return invokeInstruction("OP_INVOKE", chunk, offset);
         case OP_INVOKE_LONG:
@@ -234,6 +236,8 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return constantInstruction("OP_GET_PROPERTY", chunk, offset);
         case OP_GET_PROPERTY_LONG:
             return constantLongInstruction("OP_GET_PROPERTY", chunk, offset);
+        case OP_GET_METHOD:
+            return constantInstruction("OP_GET_METHOD", chunk, offset);
         case OP_SET_PROPERTY:
             return constantInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY_LONG:
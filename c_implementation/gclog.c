@@ -0,0 +1,169 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gclog.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// each event is put together in one buffer and written all at once,
+// so lines from a log shared with something else don't get mixed up
+typedef struct {
+    char chars[1024];
+    int length;
+} LogLine;
+
+// in `ObjType` order
+static const char* typeNames[OBJ_TYPE_COUNT] = {
+    "upvalue", "string", "native", "function", "closure",
+    "class", "instance", "bound_method", "weak_ref", "weak_table",
+};
+
+static const char* triggerNames[] = {
+    "nursery", "threshold", "stress", "scope", "limit", "freeze",
+};
+
+static const char* phaseNames[] = {
+    "idle", "marking", "sweeping",
+};
+
+// the pause histogram's buckets go up to these, in milliseconds.
+// the last bucket is everything over the last bound
+static const double bucketBounds[GC_LOG_BUCKETS - 1] = {
+    0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 25,
+};
+static size_t buckets[GC_LOG_BUCKETS];
+
+// what had been freed of the old generation as of the last pause that was logged
+static size_t oldLogged[OBJ_TYPE_COUNT];
+
+static void append(LogLine* line, const char* format, ...) {
+    int room = (int) sizeof(line->chars) - line->length;
+    if(room <= 1) return;
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(line->chars + line->length, room, format, args);
+    va_end(args);
+    line->length += written < room ? written : room - 1;
+} 
+
+static void emit(LogLine* line) {
+    append(line, "}\n");
+    const char* chars = line->chars;
+    int length = line->length;
+    while(length > 0) {
+        ssize_t written = write(vm.gcLogFd, chars, length);
+        // nowhere to write it: stop trying, rather than stop the program
+        if(written <= 0) {
+            vm.gcLogFd = -1;
+            return;
+        } 
+        chars += written;
+        length -= (int) written;
+    } 
+} 
+
+static void begin(LogLine* line, const char* event) {
+    line->length = 0;
+    append(line, "{\"event\":\"%s\",\"t_ms\":%.3f", event, (double) clock() * 1000 / CLOCKS_PER_SEC);
+} 
+
+// only the types there are any of
+static void appendCounts(LogLine* line, const char* name, size_t* counts) {
+    append(line, ",\"%s\":{", name);
+    bool first = true;
+    for(int type = 0; type < OBJ_TYPE_COUNT; type++) {
+        if(counts[type] == 0) continue;
+        append(line, "%s\"%s\":%zu", first ? "" : ",", typeNames[type], counts[type]);
+        first = false;
+    } 
+    append(line, "}");
+} 
+
+// `phase` is where the major collection was when the pause began
+void logPause(GCTrigger trigger, GCPhase phase, size_t before, int promoted,
+              double minorTime, double markTime, double sweepTime, double pause) {
+    double ms = pause * 1000;
+    int bucket = 0;
+    while(bucket < GC_LOG_BUCKETS - 1 && ms > bucketBounds[bucket]) bucket++;
+    buckets[bucket]++;
+    if(vm.gcLogFd < 0) return;
+
+    size_t freed[OBJ_TYPE_COUNT];
+    for(int type = 0; type < OBJ_TYPE_COUNT; type++) {
+        freed[type] = vm.gcFreedYoung[type] + vm.gcFreedOld[type] - oldLogged[type];
+        oldLogged[type] = vm.gcFreedOld[type];
+    } 
+    memset(vm.gcFreedYoung, 0, sizeof(vm.gcFreedYoung));
+
+    LogLine line;
+    begin(&line, "pause");
+    // a request while a cycle is running is for its next increment
+    const char* reason = trigger == GC_TRIGGER_HEAP && phase != GC_IDLE
+        ? "increment" : triggerNames[trigger];
+    append(&line, ",\"trigger\":\"%s\",\"phase\":\"%s\"", reason, phaseNames[phase]);
+    append(&line, ",\"pause_ms\":%.3f,\"minor_ms\":%.3f,\"mark_ms\":%.3f,\"sweep_ms\":%.3f",
+           ms, minorTime * 1000, markTime * 1000, sweepTime * 1000);
+    append(&line, ",\"bytes_before\":%zu,\"bytes_after\":%zu,\"promoted\":%d",
+           before, vm.bytesAllocated, promoted);
+    appendCounts(&line, "freed", freed);
+    emit(&line);
+} 
+
+// right after `adaptThreshold`, so `nextGC` is the next cycle's
+void logCycle(double survival) {
+    if(vm.gcLogFd >= 0) {
+        LogLine line;
+        begin(&line, "cycle");
+        append(&line, ",\"trigger\":\"%s\"", triggerNames[vm.gcCycleTrigger]);
+        append(&line, ",\"total_ms\":%.3f,\"mark_ms\":%.3f,\"sweep_ms\":%.3f",
+               vm.gcCycleTime * 1000, vm.gcMarkTime * 1000, vm.gcSweepTime * 1000);
+        append(&line, ",\"bytes_before\":%zu,\"bytes_after\":%zu,\"bytes_freed\":%zu",
+               vm.gcCycleStart, vm.bytesAllocated, vm.gcCycleFreed);
+        append(&line, ",\"survival\":%.3f,\"growth\":%.3f,\"next_gc\":%zu",
+               survival, vm.gcGrowth, vm.nextGC);
+        appendCounts(&line, "freed", vm.gcFreedOld);
+        emit(&line);
+    } 
+    memset(vm.gcFreedOld, 0, sizeof(vm.gcFreedOld));
+    memset(oldLogged, 0, sizeof(oldLogged));
+} 
+
+// what a request scope freed is in `vm.gcFreedYoung`, like a minor collection's
+void logScope(bool escaped, size_t bytes) {
+    if(vm.gcLogFd < 0) return;
+    LogLine line;
+    begin(&line, "scope");
+    append(&line, ",\"escaped\":%s,\"bytes\":%zu", escaped ? "true" : "false", bytes);
+    appendCounts(&line, "freed", vm.gcFreedYoung);
+    memset(vm.gcFreedYoung, 0, sizeof(vm.gcFreedYoung));
+    emit(&line);
+} 
+
+// and the histogram starts over, for the next VM
+void logSummary() {
+    if(vm.gcLogFd >= 0) {
+        LogLine line;
+        begin(&line, "summary");
+        append(&line, ",\"pauses\":%d,\"pause_total_ms\":%.3f,\"pause_max_ms\":%.3f,\"pause_mean_ms\":%.3f",
+               vm.gcPauses, vm.gcPauseTotal * 1000, vm.gcPauseMax * 1000,
+               vm.gcPauses > 0 ? vm.gcPauseTotal * 1000 / vm.gcPauses : 0.0);
+        append(&line, ",\"bytes_compacted\":%zu,\"bytes_immortal\":%zu",
+               vm.gcBytesCompacted, vm.immortalBytes);
+        // `histogram[i]` is how many pauses took at most `histogram_le_ms[i]`
+        // (and more than the one before); the last is everything longer
+        append(&line, ",\"histogram_le_ms\":[");
+        for(int i = 0; i < GC_LOG_BUCKETS - 1; i++)
+            append(&line, "%s%g", i == 0 ? "" : ",", bucketBounds[i]);
+        append(&line, "],\"histogram\":[");
+        for(int i = 0; i < GC_LOG_BUCKETS; i++)
+            append(&line, "%s%zu", i == 0 ? "" : ",", buckets[i]);
+        append(&line, "]");
+        emit(&line);
+    } 
+    memset(buckets, 0, sizeof(buckets));
+    memset(oldLogged, 0, sizeof(oldLogged));
+} 
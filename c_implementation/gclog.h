@@ -0,0 +1,23 @@
+#ifndef clox_gclog_h
+#define clox_gclog_h
+
+#include "common.h"
+#include "vm.h"
+
+// the garbage collector's event log: one JSON object per line, written to
+// `vm.gcLogFd` (`--gc-log=<fd>` or `CLOX_GC_LOG`). nothing is written while it's -1.
+//   {"event":"pause",...}   every collection: why, how long, the heap before and after,
+//                           what got promoted and freed (by type)
+//   {"event":"cycle",...}   the end of each major collection: its marking and sweeping time,
+//                           what it freed, and where the next one will start
+//   {"event":"scope",...}   the end of a request scope
+//   {"event":"summary",...} at exit, with a histogram of the pauses
+#define GC_LOG_BUCKETS 12
+
+void logPause(GCTrigger trigger, GCPhase phase, size_t before, int promoted,
+              double minorTime, double markTime, double sweepTime, double pause);
+void logCycle(double survival);
+void logScope(bool escaped, size_t bytes);
+void logSummary();
+
+#endif
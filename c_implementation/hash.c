@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+// this is the xxHash64 algorithm: it eats the string 8 bytes at a time
+// (32 at a time, in four independent lanes, for long strings)
+// instead of FNV-1a's one byte at a time.
+// the lanes don't depend on each other so the CPU can overlap them
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+// picked once per process so nobody can precompute a pile of colliding keys
+static uint64_t hashSeed = 0;
+
+void seedHash(uint64_t seed) {
+    hashSeed = seed;
+} 
+
+// not cryptographic, but differs from run to run
+uint64_t randomHashSeed() {
+    uint64_t seed = 0;
+    FILE* random = fopen("/dev/urandom", "rb");
+    if(random != NULL) {
+        if(fread(&seed, sizeof(seed), 1, random) != 1) seed = 0;
+        fclose(random);
+    } 
+    if(seed == 0) {
+        // no /dev/urandom: the time and wherever ASLR put the stack will do
+        uint64_t local = 0;
+        seed = (uint64_t) time(NULL) * PRIME64_1;
+        seed ^= (uint64_t) clock() * PRIME64_2;
+        seed ^= (uint64_t)(uintptr_t) &local * PRIME64_3;
+    } 
+    return seed;
+} 
+
+static inline uint64_t rotateLeft(uint64_t x, int bits) {
+    return (x << bits) | (x >> (64 - bits));
+} 
+
+// memcpy so unaligned reads are fine; compilers turn these into single loads
+static inline uint64_t read64(const char* p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+} 
+
+static inline uint32_t read32(const char* p) {
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+} 
+
+static inline uint64_t round64(uint64_t accumulator, uint64_t input) {
+    accumulator += input * PRIME64_2;
+    accumulator = rotateLeft(accumulator, 31);
+    return accumulator * PRIME64_1;
+} 
+
+static inline uint64_t mergeRound(uint64_t hash, uint64_t lane) {
+    hash ^= round64(0, lane);
+    return hash * PRIME64_1 + PRIME64_4;
+} 
+
+// avalanche so every input bit affects the low bits the tables mask with
+static inline uint32_t finish(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+    return (uint32_t) hash;
+} 
+
+// up to 16 bytes, which is nearly every identifier: two reads that overlap in the
+// middle cover the whole key (so together with the length they tell any two apart),
+// with no loop whose trip count changes from key to key for the branches to mispredict.
+// XXH3 does the same for its short keys
+static uint32_t hashShort(const char* key, int length) {
+    uint64_t low;
+    uint64_t high;
+    if(length >= 8) {
+        low = read64(key);
+        high = read64(key + length - 8);
+    } else if(length >= 4) {
+        low = read32(key);
+        high = read32(key + length - 4);
+    } else {
+        // the first, middle and last bytes are all of them
+        low = length == 0 ? 0 : (uint64_t)(uint8_t) key[0] |
+              (uint64_t)(uint8_t) key[length >> 1] << 8 |
+              (uint64_t)(uint8_t) key[length - 1] << 16;
+        high = 0;
+    } 
+    uint64_t hash = hashSeed + PRIME64_5 + (uint64_t) length;
+    hash ^= round64(0, low);
+    hash = rotateLeft(hash, 27) * PRIME64_1 + PRIME64_4;
+    hash ^= round64(0, high);
+    hash = rotateLeft(hash, 27) * PRIME64_1 + PRIME64_4;
+    return finish(hash);
+} 
+
+uint32_t hashString(const char* key, int length) {
+    if(length <= 16) return hashShort(key, length);
+    const char* p = key;
+    const char* end = key + length;
+    uint64_t hash;
+
+    if(length >= 32) {
+        uint64_t lane1 = hashSeed + PRIME64_1 + PRIME64_2;
+        uint64_t lane2 = hashSeed + PRIME64_2;
+        uint64_t lane3 = hashSeed;
+        uint64_t lane4 = hashSeed - PRIME64_1;
+        do {
+            lane1 = round64(lane1, read64(p));
+            lane2 = round64(lane2, read64(p + 8));
+            lane3 = round64(lane3, read64(p + 16));
+            lane4 = round64(lane4, read64(p + 24));
+            p += 32;
+        } while(p <= end - 32);
+
+        hash = rotateLeft(lane1, 1) + rotateLeft(lane2, 7) +
+               rotateLeft(lane3, 12) + rotateLeft(lane4, 18);
+        hash = mergeRound(hash, lane1);
+        hash = mergeRound(hash, lane2);
+        hash = mergeRound(hash, lane3);
+        hash = mergeRound(hash, lane4);
+    } else {
+        // too short for the lanes: just the tail
+        hash = hashSeed + PRIME64_5;
+    } 
+
+    hash += (uint64_t) length;
+
+    // whatever is left over, a word at a time, then a byte at a time
+    for(; p + 8 <= end; p += 8) {
+        hash ^= round64(0, read64(p));
+        hash = rotateLeft(hash, 27) * PRIME64_1 + PRIME64_4;
+    } 
+    if(p + 4 <= end) {
+        hash ^= (uint64_t) read32(p) * PRIME64_1;
+        hash = rotateLeft(hash, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    } 
+    for(; p < end; p++) {
+        hash ^= (uint8_t) *p * PRIME64_5;
+        hash = rotateLeft(hash, 11) * PRIME64_1;
+    } 
+
+    return finish(hash);
+} 
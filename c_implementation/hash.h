@@ -0,0 +1,10 @@
+#ifndef clox_hash_h
+#define clox_hash_h
+
+#include "common.h"
+
+void seedHash(uint64_t seed);
+uint64_t randomHashSeed();
+uint32_t hashString(const char* key, int length);
+
+#endif
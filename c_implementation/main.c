@@ -5,8 +5,26 @@
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
+#include "memory.h"
+#include "profile.h"
+#include "snapshot.h"
 #include "vm.h"
 
+// `--heap-snapshot`: where to write a snapshot of the heap once the program is done
+static const char* snapshotPath = NULL;
+
+// `--alloc-profile`: where the allocation profiler's stacks go
+static const char* profilePath = NULL;
+static size_t sampleRate = ALLOC_SAMPLE_RATE;
+
+// whatever was asked for on the command line, once the program is done
+static void writeReports() {
+	if(snapshotPath != NULL && !writeHeapSnapshot(snapshotPath))
+		fprintf(stderr, "Could not write heap snapshot \"%s\".\n", snapshotPath);
+	if(profilePath != NULL && !writeAllocationProfile(profilePath))
+		fprintf(stderr, "Could not write allocation profile \"%s\".\n", profilePath);
+} 
+
 static void repl() {
 	char line[1024];
 	for(;;) {
@@ -56,23 +74,73 @@ static char* readFile(const char* path) {
 
 static void runFile(const char* path) {
 	char* source = readFile(path);
+	// the script is compiled once and its code kept until the end,
+	// so the garbage collector can leave it alone
+	vm.immortalCode = true;
 	InterpretResult result = interpret(source);
 	free(source);
+	writeReports();
 	if(result == INTERPRET_COMPILE_ERROR) exit(65);
 	if(result == INTERPRET_RUNTIME_ERROR) exit(70);
 	
 } 
 
+static void usage() {
+	fprintf(stderr, "Usage: clox [--gc-<setting>=<value>]... [--heap-snapshot=<file>]\n");
+	fprintf(stderr, "            [--alloc-profile=<file>] [--alloc-sample=<bytes>] [path]\n");
+	fprintf(stderr, "settings: initial-heap, max-heap (bytes, or with k/m/g),\n");
+	fprintf(stderr, "          growth (factor), pause (target in ms),\n");
+	fprintf(stderr, "          compact (percent of free cells, 0 for never),\n");
+	fprintf(stderr, "          log (a file descriptor for the event log, like 2)\n");
+	fprintf(stderr, "--heap-snapshot writes what's left in the heap to <file> at the end\n");
+	fprintf(stderr, "--alloc-profile samples allocations (every %d bytes, or --alloc-sample),\n", ALLOC_SAMPLE_RATE);
+	fprintf(stderr, "    prints where they came from at the end and writes folded stacks to <file>\n");
+	exit(64);
+} 
+
 int main(int argc, const char* argv[]) {
 	initVM();
-	if(argc == 1)
+
+	// the garbage collector's settings (and the like) come first
+	int arg = 1;
+	for(; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+		if(strncmp(argv[arg], "--heap-snapshot=", 16) == 0) {
+			snapshotPath = argv[arg] + 16;
+			vm.trackAllocations = true;
+			continue;
+		} 
+		if(strncmp(argv[arg], "--alloc-profile=", 16) == 0) {
+			profilePath = argv[arg] + 16;
+			continue;
+		} 
+		if(strncmp(argv[arg], "--alloc-sample=", 15) == 0) {
+			if(!parseSize(argv[arg] + 15, &sampleRate) || sampleRate == 0) usage();
+			continue;
+		} 
+		if(strncmp(argv[arg], "--gc-", 5) != 0) usage();
+		const char* setting = argv[arg] + 5;
+		const char* equals = strchr(setting, '=');
+		if(equals == NULL) usage();
+		char name[32];
+		int length = (int) (equals - setting);
+		if(length >= (int) sizeof(name)) usage();
+		memcpy(name, setting, length);
+		name[length] = '\0';
+		if(!setGCOption(name, equals + 1)) {
+			fprintf(stderr, "Bad garbage collector setting '%s'.\n", argv[arg]);
+			exit(64);
+		} 
+	} 
+
+	if(profilePath != NULL) startAllocationProfile(sampleRate);
+
+	if(arg == argc) {
 		repl();
-	else if(argc == 2)
-		runFile(argv[1]);
-	else {
-		fprintf(stderr, "Usage: clox [path]\n");
-		exit(64);
-	}
+		writeReports();
+	} else if(arg == argc - 1)
+		runFile(argv[arg]);
+	else
+		usage();
 
 	freeVM();
 	return 0;
@@ -1,68 +1,433 @@
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #include "memory.h"
 #include "vm.h"
-#include "compiler.h"
+#include "weak.h"
+#include "snapshot.h"
+#include "profile.h"
+#include "gclog.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+#ifdef GC_CONCURRENT
+#include <pthread.h>
+#endif
 
-// seems just to be a wrapper on `realloc`
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-    vm.bytesAllocated += newSize - oldSize;
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
-    // acquiring *more* memory forces a garbage collection
-    // don't want to trigger a GC if we are freeing or shrinking an allocation
-    if(newSize > oldSize) {
-#ifdef DEBUG_STRESS_GC
-        collectGarbage();
+// when the heap gets to grow more than `vm.gcGrowFactor` (see `adaptThreshold`):
+// a cycle that found this much of the heap still alive,
+// or one that took this much of the running time since the last
+#define GC_HIGH_SURVIVAL 0.8
+#define GC_MAX_OVERHEAD 0.1
+// ...and by how much, at most
+#define GC_MAX_GROWTH_BOOST 2
+// the smallest increment `adaptSliceBudget` will go down to
+#define GC_MIN_SLICE 100
+
+// young objects are bump-allocated out of these.
+// a minor collection copies the survivors into the old generation
+// and then the whole nursery is reused in one go
+struct NurseryChunk {
+    struct NurseryChunk* next;
+    size_t used;
+    // the objects themselves follow, 8-byte aligned
+};
+
+#define NURSERY_CHUNK_SIZE (256 * 1024)
+
+#define PAGE_CELL(page, index) \
+    ((Obj*) ((char*) ((page) + 1) + (size_t) (index) * (page)->cellSize))
+// 8 bytes apart, so objects fit their cells exactly
+#define SIZE_CLASS(size) (((size) + 7) / 8 - 1)
+#define CLASS_SIZE(sizeClass) (((size_t) (sizeClass) + 1) * 8)
+// while a major collection is in progress, the mutator gets to allocate
+// this much outside of the nursery before the next increment
+#define GC_SLICE_BYTES (1024 * 1024)
+#define ALIGN_OBJECT(size) (((size) + 7) & ~(size_t) 7)
+
+#ifdef GC_CONCURRENT
+// old objects and the gray stack are shared with the background marker.
+// it holds this for a batch of objects at a time,
+// the mutator for single writes and for the minor collections
+static pthread_mutex_t heapLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t markerThread;
+static bool markerDone;
+
+#define MARKER_BATCH 256
+
+// `vm.markerActive` only changes at safepoints, so these always pair up
+void lockHeap() {
+    if(vm.markerActive) pthread_mutex_lock(&heapLock);
+} 
+
+void unlockHeap() {
+    if(vm.markerActive) pthread_mutex_unlock(&heapLock);
+} 
 #endif
-        if(vm.bytesAllocated > vm.nextGC)
-            collectGarbage();
+
+// the system itself is out of memory, as opposed to the heap being over `vm.gcMaxHeap`.
+// this happens in the middle of an allocation, where there's no stopping safely
+// (unless it came through `tryReallocate`)
+static void outOfMemory() {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+} 
+
+// pages are mapped straight from the system rather than malloc'd. malloc keeps its
+// bookkeeping right in front of each one, and writes it whenever a neighbor comes or goes,
+// so a forked worker (see `freezeHeap`) would copy the parent's pages on either side
+// of every one it allocated or freed. this way a freed page goes back to the system too.
+// NULL if the system is out of memory
+static Page* newPage(int sizeClass) {
+    // aligned to its own size, for `PAGE_OF`: map twice as much and give back the ends
+    char* mapped = (char*) mmap(NULL, 2 * PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mapped == MAP_FAILED) return NULL;
+    char* start = (char*) (((uintptr_t) mapped + PAGE_SIZE - 1) & ~(uintptr_t) (PAGE_SIZE - 1));
+    if(start > mapped) munmap(mapped, start - mapped);
+    if(start + PAGE_SIZE < mapped + 2 * PAGE_SIZE)
+        munmap(start + PAGE_SIZE, mapped + 2 * PAGE_SIZE - (start + PAGE_SIZE));
+    Page* page = (Page*) start;
+    page->next = NULL;
+    memset(page->marks, 0, sizeof(page->marks));
+    page->cellSize = (int) CLASS_SIZE(sizeClass);
+    page->cellCount = (int) ((PAGE_SIZE - sizeof(Page)) / page->cellSize);
+    page->liveCount = 0;
+    page->needsSweep = false;
+    page->freeCells = NULL;
+    return page;
+} 
+
+static void freePage(Page* page) {
+    munmap(page, PAGE_SIZE);
+} 
+
+// small buffers come out of slabs too. they are freed explicitly
+// (with their size), so one free list per size class covers every page.
+// NULL if the system is out of memory
+static void* allocateBuffer(size_t size) {
+    if(size > SLAB_MAX) return malloc(size);
+
+    int sizeClass = SIZE_CLASS(size);
+    if(vm.freeBuffers[sizeClass] == NULL) {
+        Page* page = newPage(sizeClass);
+        if(page == NULL) return NULL;
+        page->next = vm.bufferPages;
+        vm.bufferPages = page;
+        // backwards, so the cells get handed out in address order
+        for(int i = page->cellCount - 1; i >= 0; i--) {
+            void** cell = (void**) PAGE_CELL(page, i);
+            *cell = vm.freeBuffers[sizeClass];
+            vm.freeBuffers[sizeClass] = cell;
+        } 
     } 
 
+    void** cell = (void**) vm.freeBuffers[sizeClass];
+    vm.freeBuffers[sizeClass] = *cell;
+    return cell;
+} 
+
+static void freeBuffer(void* buffer, size_t size) {
+    if(buffer == NULL) return;
+    if(size > SLAB_MAX) {
+        free(buffer);
+        return;
+    } 
+    int sizeClass = SIZE_CLASS(size);
+    *(void**) buffer = vm.freeBuffers[sizeClass];
+    vm.freeBuffers[sizeClass] = buffer;
+} 
+
+// the collection itself waits for the next safepoint in `run`.
+// if several things ask before then, the first one is what gets logged
+static inline void requestGC(GCTrigger trigger) {
+    if(!vm.gcRequested) vm.gcTrigger = trigger;
+    vm.gcRequested = true;
+} 
+
+// moves a buffer to its new size, without any of the accounting.
+// NULL if the system is out of memory, in which case `pointer` is left as it was
+static void* resizeBuffer(void* pointer, size_t oldSize, size_t newSize) {
+    // big on both ends: `realloc` might be able to grow it in place
+    if(pointer != NULL && oldSize > SLAB_MAX && newSize > SLAB_MAX)
+        return realloc(pointer, newSize);
+    // still the same size class: nothing to do
+    if(pointer != NULL && oldSize <= SLAB_MAX && newSize <= SLAB_MAX &&
+            SIZE_CLASS(oldSize) == SIZE_CLASS(newSize)) {
+        return pointer;
+    } 
+
+    void* result = allocateBuffer(newSize);
+    if(result == NULL) return NULL;
+    if(pointer != NULL) {
+        memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+        freeBuffer(pointer, oldSize);
+    } 
+    return result;
+} 
+
+// acquiring *more* memory asks for a garbage collection
+// don't want to trigger a GC if we are freeing or shrinking an allocation.
+// the collection itself waits for the next safepoint in `run`,
+// since whoever called this might be holding onto a young object
+static inline void grew() {
+    if(vm.bytesAllocated > vm.nextGC)
+        requestGC(GC_TRIGGER_HEAP);
+#ifdef DEBUG_STRESS_GC
+    requestGC(GC_TRIGGER_STRESS);
+#endif
+} 
+
+// seems just to be a wrapper on `realloc`
+// (every caller passes the real old size, which is what lets small buffers live in slabs).
+// this one can't fail: past `vm.gcMaxHeap` it still gets the memory,
+// and the safepoint right after deals with it
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+    vm.bytesAllocated += newSize - oldSize;
+    if(newSize > oldSize) grew();
+
 	if(newSize == 0) {
-		free(pointer);
+		freeBuffer(pointer, oldSize);
 		// return NULL ptr? yikes
 		return NULL;
 	} 
 
-	void* result = realloc(pointer, newSize);
-	if(result == NULL) exit(1);
-	return result;
+    void* result = resizeBuffer(pointer, oldSize, newSize);
+    if(result == NULL) outOfMemory();
+    return result;
 } 
 
-void markObject(Obj* object) {
-    if(object == NULL) return;
-    if(object->isMarked) return; // already've done the work for this object
-#ifdef DEBUG_LOG_GC
-    printf("%p mark ", (void*) object);
-    printValue(OBJ_VAL(object));
-    printf("\n");
+// `reallocate` for growing something its caller can back out of:
+// big buffers, whose size a script controls (a rope's characters, a table).
+// rather than take the heap over `vm.gcMaxHeap`, it asks for nothing and returns NULL,
+// leaving `pointer` as it was, and likewise if the system is out of memory.
+// the collection at the next safepoint counts what it turned down as allocated,
+// so that's the last chance before a runtime error; a caller at a safepoint
+// of its own can have it right away (see `collectToRetry` in vm.c)
+void* tryReallocate(void* pointer, size_t oldSize, size_t newSize) {
+    if(newSize <= oldSize) return reallocate(pointer, oldSize, newSize);
+    size_t growth = newSize - oldSize;
+    if(vm.gcMaxHeap > 0 && vm.bytesAllocated + growth > vm.gcMaxHeap) {
+        vm.refusedBytes += growth;
+        requestGC(GC_TRIGGER_LIMIT);
+        return NULL;
+    } 
+
+    void* result = resizeBuffer(pointer, oldSize, newSize);
+    if(result == NULL) {
+        vm.systemOutOfMemory = true;
+        requestGC(GC_TRIGGER_LIMIT);
+        return NULL;
+    } 
+    vm.bytesAllocated += growth;
+    grew();
+    return result;
+} 
+
+// every new object starts out here
+void* allocateYoung(size_t size) {
+    size = ALIGN_OBJECT(size);
+    NurseryChunk* chunk = vm.nursery;
+
+    if(chunk == NULL || chunk->used + size > NURSERY_CHUNK_SIZE) {
+        // a full nursery means it's time for a minor collection,
+        // but until the next safepoint just keep going in a fresh chunk
+        if(chunk != NULL) requestGC(GC_TRIGGER_NURSERY);
+
+        NurseryChunk* fresh = (NurseryChunk*) malloc(sizeof(NurseryChunk) + NURSERY_CHUNK_SIZE);
+        if(fresh == NULL) outOfMemory();
+        fresh->next = chunk;
+        fresh->used = 0;
+        vm.nursery = chunk = fresh;
+    } 
+
+    void* object = (char*) (chunk + 1) + chunk->used;
+    chunk->used += size;
+
+    vm.bytesAllocated += size;
+    if(vm.bytesAllocated > vm.nextGC)
+        requestGC(GC_TRIGGER_HEAP);
+#ifdef DEBUG_STRESS_GC
+    requestGC(GC_TRIGGER_STRESS);
 #endif
 
-    // mark the object via a field
-    object->isMarked = true;
+    return object;
+} 
+
+// while a request scope is open, new objects go into its arena instead of the nursery.
+// nothing collects them until the scope ends (see `releaseArena`)
+void* allocateScoped(size_t size) {
+    size = ALIGN_OBJECT(size);
+    NurseryChunk* chunk = vm.arena;
+    if(chunk == NULL || chunk->used + size > NURSERY_CHUNK_SIZE) {
+        NurseryChunk* fresh = (NurseryChunk*) malloc(sizeof(NurseryChunk) + NURSERY_CHUNK_SIZE);
+        if(fresh == NULL) outOfMemory();
+        fresh->next = chunk;
+        fresh->used = 0;
+        vm.arena = chunk = fresh;
+    } 
+
+    void* object = (char*) (chunk + 1) + chunk->used;
+    chunk->used += size;
+    // the safepoint doesn't collect inside a scope, but it does check the limit
+    vm.bytesAllocated += size;
+    if(vm.bytesAllocated > vm.nextGC)
+        requestGC(GC_TRIGGER_HEAP);
+    return object;
+} 
+
+// the main script's code (see `vm.immortalAllocation`) is never freed.
+// it goes into pages of its own, bump-allocated like the nursery, whose mark bits
+// are all set for good: marking stops at it and no sweep ever looks at it.
+// it only ever points at other immortal objects, so it never needs tracing either
+void* allocateImmortal(size_t size) {
+    size = ALIGN_OBJECT(size);
+    Page* page = vm.immortalPages;
+    if(page == NULL || vm.immortalTop + size > (char*) page + PAGE_SIZE) {
+        page = newPage(0);
+        if(page == NULL) outOfMemory();
+        memset(page->marks, 0xff, sizeof(page->marks));
+        page->cellSize = 0; // see `isImmortal`
+        page->cellCount = 0;
+        page->next = vm.immortalPages;
+        vm.immortalPages = page;
+        vm.immortalTop = (char*) (page + 1);
+    } 
 
-    // uses `realloc` instead of `reallocate` wrapper bc the GC
-    // activates via uses of `reallocate`
-    // this thing's memory will be managed explicitly
+    void* object = vm.immortalTop;
+    vm.immortalTop += size;
+    page->cellCount++;
+    page->liveCount++;
+    vm.bytesAllocated += size;
+    vm.immortalBytes += size;
+    return object;
+} 
+
+static size_t typeSize(ObjType type) {
+    switch(type) {
+        case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+        case OBJ_INSTANCE: return sizeof(ObjInstance);
+        case OBJ_CLASS: return sizeof(ObjClass);
+        case OBJ_CLOSURE: return sizeof(ObjClosure);
+        case OBJ_FUNCTION: return sizeof(ObjFunction);
+        case OBJ_NATIVE: return sizeof(ObjNative);
+        case OBJ_STRING: return sizeof(ObjString);
+        case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+        case OBJ_WEAK_REF: return sizeof(ObjWeakRef);
+        case OBJ_WEAK_TABLE: return sizeof(ObjWeakTable);
+    } 
+    return 0; // unreachable
+} 
+
+static size_t objectSize(Obj* object) {
+    // a closure's upvalues come after it
+    if(object->type == OBJ_CLOSURE)
+        return sizeof(ObjClosure) + sizeof(ObjUpvalue*) * ((ObjClosure*) object)->upvalueCount;
+    return typeSize(object->type);
+} 
+
+// a new slab for the old generation, all of it free
+static Page* newObjectPage(int sizeClass) {
+    Page* page = newPage(sizeClass);
+    if(page == NULL) outOfMemory();
+    // backwards, so the cells get handed out in address order
+    for(int i = page->cellCount - 1; i >= 0; i--) {
+        Obj* cell = PAGE_CELL(page, i);
+        cell->isOld = false;
+        OBJ_LINK(cell) = page->freeCells;
+        page->freeCells = cell;
+    } 
+
+    // new pages go at the end, so `allocPage` only ever moves forward
+    ObjSpace* space = &vm.spaces[sizeClass];
+    if(space->lastPage == NULL) space->pages = page;
+    else space->lastPage->next = page;
+    space->lastPage = page;
+    return page;
+} 
+
+// uses `realloc` instead of `reallocate` wrapper bc the GC
+// activates via uses of `reallocate`
+// this thing's memory will be managed explicitly
+static void pushGray(Obj* object) {
     if(vm.grayCapacity < vm.grayCount + 1) {
         vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
         vm.grayStack = (Obj**) realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
 
         // must handle allocation failure
-        if(vm.grayStack == NULL) exit(1);
+        if(vm.grayStack == NULL) outOfMemory();
     } 
 
-    // add the marked object to the gray array
     vm.grayStack[vm.grayCount++] = object;
 } 
 
+// the slow half of `writeBarrier`
+void rememberObject(Obj* object) {
+    if(object->isRemembered) return;
+    object->isRemembered = true;
+
+    if(vm.rememberedCapacity < vm.rememberedCount + 1) {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Obj**) realloc(vm.remembered, sizeof(Obj*) * vm.rememberedCapacity);
+        if(vm.remembered == NULL) outOfMemory();
+    } 
+
+    vm.remembered[vm.rememberedCount++] = object;
+} 
+
+// a frozen object that has been written is a root of every collection from then on
+void rememberFrozen(Obj* object) {
+    object->isFrozenRoot = true;
+    if(vm.frozenRootCapacity < vm.frozenRootCount + 1) {
+        vm.frozenRootCapacity = GROW_CAPACITY(vm.frozenRootCapacity);
+        vm.frozenRoots = (Obj**) realloc(vm.frozenRoots, sizeof(Obj*) * vm.frozenRootCapacity);
+        if(vm.frozenRoots == NULL) outOfMemory();
+    } 
+    vm.frozenRoots[vm.frozenRootCount++] = object;
+} 
+
+// for when too much of `object` changes at once to go through `writeBarrier`:
+// just assume the worst and look at all of it again
+void writeBarrierAll(Obj* object) {
+    if(vm.scopeOpen && !object->isScoped) vm.scopeEscaped = true;
+    if(!object->isOld) return;
+    if(object->isFrozen && !object->isFrozenRoot) rememberFrozen(object);
+    rememberObject(object);
+#ifndef GC_CONCURRENT
+    if(vm.gcPhase == GC_MARKING && isMarked(object))
+        pushGray(object);
+#endif
+} 
+
+void markObject(Obj* object) {
+    if(object == NULL) return;
+    // young objects are the minor collections' business.
+    // any that survive get promoted (and marked) before marking finishes
+    if(!object->isOld) return;
+    if(isMarked(object)) return; // already've done the work for this object
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*) object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    // mark the object in its page's bitmap
+    setMarked(object);
+
+    // add the marked object to the gray array
+    pushGray(object);
+} 
+
 void markValue(Value value) {
     // numbers, booleans, nil are stored inline in Value structs
     // and require no heap allocation
@@ -75,6 +440,16 @@ static void markArray(ValueArray* array) {
         markValue(array->values[i]);
 } 
 
+// weak references and tables seen by this cycle's marking
+static void rememberWeak(Obj* object) {
+    if(vm.weakCapacity < vm.weakCount + 1) {
+        vm.weakCapacity = GROW_CAPACITY(vm.weakCapacity);
+        vm.weakObjects = (Obj**) realloc(vm.weakObjects, sizeof(Obj*) * vm.weakCapacity);
+        if(vm.weakObjects == NULL) outOfMemory();
+    } 
+    vm.weakObjects[vm.weakCount++] = object;
+} 
+
 static void blackenObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void*) object);
@@ -101,8 +476,8 @@ static void blackenObject(Obj* object) {
             break;
         } 
         case OBJ_CLOSURE: {
-            // closures reference the function it wraps and the array of pointers
-            // to the upvalue it captures
+            // closures reference the function it wraps and the pointers
+            // to the upvalues it captures
             ObjClosure* closure = (ObjClosure*) object;
             markObject((Obj*) closure->function);
             for(int i = 0; i < closure->upvalueCount; i++)
@@ -113,77 +488,131 @@ static void blackenObject(Obj* object) {
             ObjFunction* function = (ObjFunction*) object;
             markObject((Obj*) function->name); // must mark the function's name
             markArray(&function->chunk.constants); // as well as its constant array
+            markObject((Obj*) function->closure);
             break;
         } 
         case OBJ_UPVALUE:
             // if an upvalue is closed the value lives in this field
             markValue(((ObjUpvalue*) object)->closed);
             break;
+        case OBJ_STRING: {
+            // a rope keeps both of its halves alive until it is flattened
+            ObjString* string = (ObjString*) object;
+            markObject((Obj*) string->left);
+            markObject((Obj*) string->right);
+            break;
+        } 
+        // the weak parts wait until the end of marking (see `clearWeakReferences`)
+        case OBJ_WEAK_REF:
+            rememberWeak(object);
+            break;
+        case OBJ_WEAK_TABLE: {
+            ObjWeakTable* table = (ObjWeakTable*) object;
+            rememberWeak(object);
+            for(int i = 0; i < table->capacity; i++) {
+                WeakEntry* entry = &table->entries[i];
+                if(IS_NIL(entry->key)) continue;
+                if(!table->weakKeys) markValue(entry->key);
+                // with weak keys, a value is only marked once its key is (see `markEphemerons`)
+                if(!table->weakKeys && !table->weakValues) markValue(entry->value);
+            } 
+            break;
+        } 
         // these shouldn't even be gray to begin with
         case OBJ_NATIVE:
-        case OBJ_STRING:
             break;
     } 
 } 
 
-static void freeObject(Obj* object) {
-#ifdef DEBUG_LOG_GC
-    printf("%p free type %d\n", (void*) object, object->type);
-#endif
-
+// frees whatever an object owns, but not the object itself.
+// dead young objects only need this, the nursery is reused wholesale
+static void freeContents(Obj* object) {
 	switch(object->type) {
-        case OBJ_BOUND_METHOD:
-            // does not *own* any of its references
-            FREE(ObjBoundMethod, object);
-            break;
-        case OBJ_INSTANCE: {
-            ObjInstance* instance = (ObjInstance*) object;
-            freeTable(&instance->fields); // owns its table
-            FREE(ObjInstance, object);
+        case OBJ_INSTANCE:
+            freeTable(&((ObjInstance*) object)->fields); // owns its table
             break;
-        } 
-        case OBJ_CLASS: {
+        case OBJ_CLASS:
             // does not own its name
-            ObjClass* klass = (ObjClass*) object;
-            freeTable(&klass->methods);
-            FREE(ObjClass, object);
-            break;
-        } 
-        case OBJ_CLOSURE: {
-            // we do *not* free the function because the closure does not own it
-            // there could be several closures that reference the same function
-            FREE(ObjClosure, object);
+            freeTable(&((ObjClass*) object)->methods);
             break;
-        } 
-        case OBJ_FUNCTION: {
-            ObjFunction* function = (ObjFunction*) object;
-            freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
+        case OBJ_FUNCTION:
             // there is no need here to free the function's name
             // because it is an ObjString.
             // so, the garbage collector can manage its lifetime for us.
-            break;
-        } 
-        case OBJ_NATIVE:
-            FREE(ObjNative, object);
+            freeChunk(&((ObjFunction*) object)->chunk);
+            // something else might get its address (see `currentSite`)
+            if(vm.trackAllocations) forgetSiteCache();
             break;
 		case OBJ_STRING: {
 			ObjString* string = (ObjString*) object;
-			// free whatever's been allocated
-			FREE_ARRAY(char, string->chars, string->length + 1);
-			// have to free the actual entire object
-			FREE(ObjString, object);
-			//reallocate(object, sizeof(ObjString) + sizeof(char)*(string->length + 1), 0);
-
+			// free whatever's been allocated (ropes don't have a buffer yet)
+			if(string->chars != NULL)
+				FREE_ARRAY(char, string->chars, string->length + 1);
 			break;
 		} 
-        case OBJ_UPVALUE:
-            // multiple upvalues can close over the same variable
-            FREE(ObjUpvalue, object);
+        case OBJ_WEAK_TABLE: {
+            ObjWeakTable* table = (ObjWeakTable*) object;
+            FREE_ARRAY(WeakEntry, table->entries, table->capacity);
+            break;
+        } 
+        // bound methods and upvalues do not *own* any of their references.
+        // we do *not* free a closure's function because the closure does not own it:
+        // there could be several closures that reference the same function
+        default:
             break;
 	} 
 } 
 
+static void freeObject(Page* page, Obj* object) {
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*) object, object->type);
+#endif
+    freeContents(object);
+    vm.gcFreedOld[object->type]++;
+    // the cell goes back to its page
+    object->isOld = false;
+    OBJ_LINK(object) = page->freeCells;
+    page->freeCells = object;
+    page->liveCount--;
+    vm.bytesAllocated -= page->cellSize;
+    vm.gcCycleFreed += page->cellSize;
+} 
+
+// frees whatever didn't get marked this cycle.
+// returns how many cells it had to look at
+static int sweepPage(Page* page) {
+    for(int i = 0; i < page->cellCount; i++) {
+        Obj* object = PAGE_CELL(page, i);
+        if(!object->isOld) continue; // already free
+        if(!isMarked(object)) freeObject(page, object);
+    } 
+    // and the whole bitmap is ready for the next marking in one go
+    memset(page->marks, 0, sizeof(page->marks));
+    page->needsSweep = false;
+    return page->cellCount;
+} 
+
+// where promoted objects go
+static Obj* allocateOld(size_t size) {
+    int sizeClass = SIZE_CLASS(size);
+    ObjSpace* space = &vm.spaces[sizeClass];
+    Page* page = space->allocPage;
+    for(; page != NULL; page = page->next) {
+        // sweeping is lazy: a page that is still waiting for it
+        // gets swept as soon as we want one of its cells
+        if(page->needsSweep) sweepPage(page);
+        if(page->freeCells != NULL) break;
+    } 
+    if(page == NULL) page = newObjectPage(sizeClass);
+    space->allocPage = page;
+
+    Obj* cell = page->freeCells;
+    page->freeCells = OBJ_LINK(cell);
+    page->liveCount++;
+    vm.bytesAllocated += page->cellSize;
+    return cell;
+} 
+
 static void markRoots() {
     // value stack
     for(Value* slot = vm.stack; slot < vm.stackTop; slot++) {
@@ -197,19 +626,18 @@ static void markRoots() {
     for(int i = 0; i < vm.frameCount; i++)
         markObject((Obj*) vm.frames[i].closure);
 
-    // open upvalue list
-    for(ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL;
-            upvalue = upvalue->next) {
-        markObject((Obj*) upvalue);
-    } 
+    // open upvalues
+    for(int slot = 0; slot < vm.openUpvalueEnd; slot++)
+        markObject((Obj*) vm.openUpvalues[slot]);
 
-    // global names
-    markTable(&vm.globalNames);
-    // constant global names
-    markTable(&constantGlobals);
+    // frozen objects are marked for good, so this is the only way
+    // what they have been given since they were frozen gets marked
+    for(int i = 0; i < vm.frozenRootCount; i++)
+        pushGray(vm.frozenRoots[i]);
 
-    markCompilerRoots();
-    markObject((Obj*) vm.initString);
+    // the names of the globals, unless they all came from the main script
+    // (`vm.initString` is always immortal, and the compiler never runs during a collection)
+    if(vm.mortalNames) markTable(&vm.globalNames);
 } 
 
 static void traceReferences() {
@@ -219,39 +647,427 @@ static void traceReferences() {
     } 
 } 
 
-// go through the objects linked list that we have
-static void sweep() {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
+// an increment of marking, at most `*work` objects.
+// returns `true` once there is nothing gray left
+static bool markSlice(int* work) {
+    while(vm.grayCount > 0) {
+        if(*work <= 0) return false;
+        (*work)--;
+        Obj* object = vm.grayStack[--vm.grayCount];
+        blackenObject(object);
+    } 
+    return true;
+} 
 
-    while(object != NULL) {
-        if(object->isMarked) {
-            object->isMarked = false; // for the next marking
-            previous = object; // previous is this object
-            object = object->next; // iterate to next one
+// an increment of sweeping, for whichever pages allocation hasn't gotten to.
+// returns `true` once every page has been swept this cycle
+static bool sweepSlice(int* work) {
+    for(int sizeClass = 0; sizeClass < OBJECT_CLASS_COUNT; sizeClass++) {
+        ObjSpace* space = &vm.spaces[sizeClass];
+        while(space->sweepPage != NULL) {
+            if(*work <= 0) return false;
+            Page* page = space->sweepPage;
+            if(page->needsSweep) *work -= sweepPage(page);
+            space->sweepPage = page->next;
+        } 
+    } 
+    return true;
+} 
+
+// copies an object to `copy`, in the old generation or the immortal region.
+// the stale copy keeps its new address (`OBJ_LINK`) for everyone else pointing at it
+static Obj* forwardObject(Obj* object, Obj* copy) {
+    size_t size = objectSize(object);
+    memcpy(copy, object, size);
+    copy->isOld = true;
+
+    // a closed upvalue points at its own field
+    if(object->type == OBJ_UPVALUE) {
+        ObjUpvalue* upvalue = (ObjUpvalue*) copy;
+        if(upvalue->location == &((ObjUpvalue*) object)->closed)
+            upvalue->location = &upvalue->closed;
+    } 
+
+    if(vm.trackAllocations) trackMove(object, copy);
+    object->isForwarded = true;
+    OBJ_LINK(object) = copy;
+    return copy;
+} 
+
+// copies an object into a cell of the old generation
+static Obj* moveObject(Obj* object) {
+    return forwardObject(object, allocateOld(objectSize(object)));
+} 
+
+// promotes a young object, once.
+// old objects are only ever forwarded while the heap is being compacted or frozen
+Obj* evacuateObject(Obj* object) {
+    if(object == NULL) return object;
+    if(object->isForwarded) return OBJ_LINK(object);
+    if(object->isOld) return object;
+
+    Obj* copy = moveObject(object);
+    // promoted in the middle of marking: see `collectYoung`
+    if(vm.gcPhase == GC_MARKING) setMarked(copy);
+
+#ifdef DEBUG_LOG_GC
+    // not printed: its fields might still point at forwarded objects
+    printf("%p promote to %p type %d\n", (void*) object, (void*) copy, copy->type);
+#endif
+
+    // its fields still need evacuating
+    pushGray(copy);
+    return copy;
+} 
+
+void evacuateValue(Value* slot) {
+    if(IS_OBJ(*slot)) *slot = OBJ_VAL(evacuateObject(AS_OBJ(*slot)));
+} 
+
+static void evacuateArray(ValueArray* array) {
+    for(int i = 0; i < array->count; i++)
+        evacuateValue(&array->values[i]);
+} 
+
+// `blackenObject`, but rewriting each young reference to point at its copy
+static void scanObject(Obj* object) {
+    switch(object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*) object;
+            evacuateValue(&bound->receiver);
+            bound->method = (ObjClosure*) evacuateObject((Obj*) bound->method);
+            break;
+        } 
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*) object;
+            instance->klass = (ObjClass*) evacuateObject((Obj*) instance->klass);
+            evacuateTable(&instance->fields);
+            break;
+        } 
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*) object;
+            klass->name = (ObjString*) evacuateObject((Obj*) klass->name);
+            evacuateTable(&klass->methods);
+            break;
+        } 
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*) object;
+            closure->function = (ObjFunction*) evacuateObject((Obj*) closure->function);
+            for(int i = 0; i < closure->upvalueCount; i++)
+                closure->upvalues[i] = (ObjUpvalue*) evacuateObject((Obj*) closure->upvalues[i]);
+            break;
+        } 
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*) object;
+            function->name = (ObjString*) evacuateObject((Obj*) function->name);
+            evacuateArray(&function->chunk.constants);
+            function->closure = (ObjClosure*) evacuateObject((Obj*) function->closure);
+            break;
+        } 
+        case OBJ_UPVALUE:
+            evacuateValue(&((ObjUpvalue*) object)->closed);
+            break;
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*) object;
+            string->left = (ObjString*) evacuateObject((Obj*) string->left);
+            string->right = (ObjString*) evacuateObject((Obj*) string->right);
+            break;
+        } 
+        // minor collections treat weak references as strong ones.
+        // only the major collections clear them
+        case OBJ_WEAK_REF:
+            evacuateValue(&((ObjWeakRef*) object)->target);
+            break;
+        case OBJ_WEAK_TABLE: {
+            ObjWeakTable* table = (ObjWeakTable*) object;
+            bool moved = false;
+            for(int i = 0; i < table->capacity; i++) {
+                WeakEntry* entry = &table->entries[i];
+                if(IS_NIL(entry->key)) continue;
+                Value key = entry->key;
+                evacuateValue(&entry->key);
+                if(IS_OBJ(key) && AS_OBJ(key) != AS_OBJ(entry->key)) moved = true;
+                evacuateValue(&entry->value);
+            } 
+            // keys hash by address
+            if(moved) weakTableRehash(table);
+            break;
+        } 
+        case OBJ_NATIVE:
+            break;
+    } 
+} 
+
+// same roots as `markRoots`.
+// the compiler never runs during a collection, so it has none anyway
+static void evacuateRoots() {
+    for(Value* slot = vm.stack; slot < vm.stackTop; slot++)
+        evacuateValue(slot);
+
+    evacuateArray(&vm.globalValues);
+
+    for(int i = 0; i < vm.frameCount; i++)
+        vm.frames[i].closure = (ObjClosure*) evacuateObject((Obj*) vm.frames[i].closure);
+
+    for(int slot = 0; slot < vm.openUpvalueEnd; slot++)
+        vm.openUpvalues[slot] = (ObjUpvalue*) evacuateObject((Obj*) vm.openUpvalues[slot]);
+
+    if(vm.mortalNames) evacuateTable(&vm.globalNames);
+
+    // and old objects that have been written young ones
+    for(int i = 0; i < vm.rememberedCount; i++) {
+        vm.remembered[i]->isRemembered = false;
+        scanObject(vm.remembered[i]);
+    } 
+    vm.rememberedCount = 0;
+} 
+
+// whatever wasn't copied out is dead
+static void sweepNursery() {
+    NurseryChunk* chunk = vm.nursery;
+    while(chunk != NULL) {
+        char* start = (char*) (chunk + 1);
+        for(char* cursor = start; cursor < start + chunk->used; ) {
+            Obj* object = (Obj*) cursor;
+            size_t size = ALIGN_OBJECT(objectSize(object));
+            if(!object->isForwarded) {
+#ifdef DEBUG_LOG_GC
+                printf("%p free type %d\n", (void*) object, object->type);
+#endif
+                freeContents(object);
+                vm.gcFreedYoung[object->type]++;
+            } 
+            vm.bytesAllocated -= size;
+            cursor += size;
+        } 
+
+        // hang onto the newest chunk for the next round of allocations
+        NurseryChunk* next = chunk->next;
+        if(chunk == vm.nursery) {
+            chunk->next = NULL;
+            chunk->used = 0;
         } else {
-            Obj* unreached = object;
-            object = object->next; // iterate
-            // remove `unreached` from the linked list
-            if(previous != NULL) {
-                previous->next = object; 
+            free(chunk);
+        } 
+        chunk = next;
+    } 
+} 
+
+// a minor collection: everything young that is still reachable
+// gets promoted, and the nursery starts over empty.
+// returns how many objects were promoted
+static int collectYoung() {
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm.bytesAllocated;
+#endif
+    // the gray stack might be halfway through a major collection,
+    // so the copies go on top of it and get scanned in the order they were made
+    int grayBase = vm.grayCount;
+    evacuateRoots();
+    for(int i = grayBase; i < vm.grayCount; i++)
+        scanObject(vm.grayStack[i]);
+    tableSweepYoung(&vm.strings);
+    sweepNursery();
+
+    // anything promoted in the middle of marking is as good as a root,
+    // since it may be the only thing left pointing at some white object.
+    // those copies were marked when they were made, so they just stay gray
+    int promoted = vm.grayCount - grayBase;
+    if(vm.gcPhase != GC_MARKING) vm.grayCount = grayBase;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu)\n",
+           before - vm.bytesAllocated, before, vm.bytesAllocated);
+#endif
+    return promoted;
+} 
+
+// the end of a request scope.
+// if none of its objects were stored anywhere older than the scope,
+// the whole arena is garbage and gets freed without tracing any of it.
+// otherwise it is handed over to the nursery as it is, and a minor collection
+// promotes whatever escaped, like it would any young object
+void releaseArena(bool escaped) {
+    NurseryChunk* chunk = vm.arena;
+    vm.arena = NULL;
+    size_t bytes = 0;
+
+    while(chunk != NULL) {
+        char* start = (char*) (chunk + 1);
+        for(char* cursor = start; cursor < start + chunk->used; ) {
+            Obj* object = (Obj*) cursor;
+            size_t size = ALIGN_OBJECT(objectSize(object));
+            bytes += size;
+            if(escaped) {
+                object->isScoped = false;
             } else {
-                vm.objects = object; // or it's the start, so we reassign vm.objects
+                if(object->type == OBJ_STRING && ((ObjString*) object)->isInterned)
+                    tableDelete(&vm.strings, (ObjString*) object);
+                freeContents(object);
+                vm.gcFreedYoung[object->type]++;
+                vm.bytesAllocated -= size;
             } 
+            cursor += size;
+        } 
 
-            freeObject(unreached);
+        NurseryChunk* next = chunk->next;
+        if(escaped) {
+            // behind the chunk allocation is going on in
+            if(vm.nursery == NULL) {
+                chunk->next = NULL;
+                vm.nursery = chunk;
+            } else {
+                chunk->next = vm.nursery->next;
+                vm.nursery->next = chunk;
+            } 
+        } else {
+            free(chunk);
         } 
+        chunk = next;
+    } 
+
+#ifdef DEBUG_LOG_GC
+    if(escaped) printf("-- request scope escaped, %zu bytes moved to the nursery\n", bytes);
+    else printf("-- request scope freed %zu bytes of objects\n", bytes);
+#endif
+    logScope(escaped, bytes);
+    // the end of a scope is as good as a safepoint, and the next scope
+    // would put off collecting until it's over too
+    if(escaped) {
+        requestGC(GC_TRIGGER_SCOPE);
+        collectGarbage();
     } 
 } 
 
-void collectGarbage() {
+#ifdef GC_CONCURRENT
+static void* markInBackground(void* unused) {
+    (void) unused;
+    for(;;) {
+        pthread_mutex_lock(&heapLock);
+        int work = MARKER_BATCH;
+        bool done = markSlice(&work);
+        markerDone = done;
+        pthread_mutex_unlock(&heapLock);
+        // anything grayed after this is left for `finishMarking`
+        if(done) return NULL;
+    } 
+} 
+
+static void startMarker() {
+    markerDone = false;
+    vm.markerActive = true;
+    if(pthread_create(&markerThread, NULL, markInBackground, NULL) != 0) {
+        // no thread, no problem: it all gets marked at the end instead
+        vm.markerActive = false;
+        markerDone = true;
+    } 
+} 
+
+static void stopMarker() {
+    if(!vm.markerActive) return;
+    pthread_join(markerThread, NULL);
+    vm.markerActive = false;
+} 
+
+static bool markerFinished() {
+    lockHeap();
+    bool done = markerDone;
+    unlockHeap();
+    if(done) stopMarker();
+    return done;
+} 
+#endif
+
+// the roots are scanned here, on the mutator,
+// and the rest is marked in slices or in the background
+static void startCycle(GCTrigger trigger) {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
 #endif
-
+    vm.gcCycleTrigger = trigger;
+    vm.gcCycleStart = vm.bytesAllocated;
+    vm.gcCycleTime = 0;
+    vm.gcMarkTime = 0;
+    vm.gcSweepTime = 0;
+    vm.gcCycleFreed = 0;
+    // marking looks at every live object, and sweeping at every cell
+    vm.gcCycleWork = 0;
+    for(int sizeClass = 0; sizeClass < OBJECT_CLASS_COUNT; sizeClass++) {
+        for(Page* page = vm.spaces[sizeClass].pages; page != NULL; page = page->next)
+            vm.gcCycleWork += page->liveCount + page->cellCount;
+    } 
+    vm.gcLastSlice = vm.bytesAllocated;
+    vm.gcPhase = GC_MARKING;
     markRoots(); // mark initial nodes
+#ifdef GC_CONCURRENT
+    startMarker();
+#endif
+} 
+
+// whether marking got to a value. anything young was just promoted, so it's alive
+static bool isAlive(Value value) {
+    return !IS_OBJ(value) || !AS_OBJ(value)->isOld || isMarked(AS_OBJ(value));
+} 
+
+// an entry of a weak-keyed table keeps its value alive only as long as its key is alive
+// through something else. marking one value can make another key reachable,
+// so this goes around until nothing new gets marked
+static void markEphemerons() {
+    bool marked;
+    do {
+        marked = false;
+        // tracing can add more tables to the list, so no caching its count
+        for(int i = 0; i < vm.weakCount; i++) {
+            if(vm.weakObjects[i]->type != OBJ_WEAK_TABLE) continue;
+            ObjWeakTable* table = (ObjWeakTable*) vm.weakObjects[i];
+            if(!table->weakKeys || table->weakValues) continue;
+            for(int j = 0; j < table->capacity; j++) {
+                WeakEntry* entry = &table->entries[j];
+                if(IS_NIL(entry->key) || !isAlive(entry->key) || isAlive(entry->value)) continue;
+                markValue(entry->value);
+                marked = true;
+            } 
+        } 
+        traceReferences();
+    } while(marked);
+} 
+
+// marking is done: whatever a weak reference or table was
+// the only thing pointing at is about to be swept
+static void clearWeakReferences() {
+    for(int i = 0; i < vm.weakCount; i++) {
+        Obj* object = vm.weakObjects[i];
+        if(object->type == OBJ_WEAK_REF) {
+            ObjWeakRef* ref = (ObjWeakRef*) object;
+            if(!isAlive(ref->target)) ref->target = NIL_VAL;
+            continue;
+        } 
+
+        ObjWeakTable* table = (ObjWeakTable*) object;
+        for(int j = 0; j < table->capacity; j++) {
+            WeakEntry* entry = &table->entries[j];
+            if(IS_NIL(entry->key)) continue;
+            if((table->weakKeys && !isAlive(entry->key)) ||
+                    (table->weakValues && !isAlive(entry->value))) {
+                entry->key = NIL_VAL;
+                entry->value = BOOL_VAL(true); // tombstone
+                table->count--;
+                table->tombstones++;
+            } 
+        } 
+    } 
+    vm.weakCount = 0;
+} 
+
+// the roots have changed since marking began, so this last bit is done all at once.
+// young objects don't need looking at: they were just promoted and marked
+static void finishMarking() {
+    markRoots();
     traceReferences(); // graph traversal
+    markEphemerons();
+    clearWeakReferences();
     tableRemoveWhite(&vm.strings); // remove elements in string table that are white
 /*
     Obj* object = vm.objects;
@@ -267,25 +1083,609 @@ void collectGarbage() {
     } 
 */
 
-    // calls `reallocate` which reduces the number of `bytesAllocated`
-    sweep(); // remove the white nodes
+    // every page needs sweeping now, either when allocation
+    // gets to it or in the increments, whichever comes first
+    for(int sizeClass = 0; sizeClass < OBJECT_CLASS_COUNT; sizeClass++) {
+        ObjSpace* space = &vm.spaces[sizeClass];
+        for(Page* page = space->pages; page != NULL; page = page->next)
+            page->needsSweep = true;
+        space->allocPage = space->pages;
+        space->sweepPage = space->pages;
+    } 
+    vm.gcPhase = GC_SWEEPING;
+} 
+
+// gives pages with nothing left in them back
+static void freeEmptyPages(ObjSpace* space) {
+    Page* previous = NULL;
+    Page* page = space->pages;
+    while(page != NULL) {
+        Page* next = page->next;
+        if(page->liveCount == 0) {
+            if(previous == NULL) space->pages = next;
+            else previous->next = next;
+            freePage(page);
+        } else {
+            previous = page;
+        } 
+        page = next;
+    } 
+    space->lastPage = previous;
+    space->allocPage = space->pages;
+} 
+
+static int compareLiveCounts(const void* a, const void* b) {
+    return (*(Page* const*) b)->liveCount - (*(Page* const*) a)->liveCount;
+} 
+
+// if too much of a size class is free cells scattered over its pages,
+// moves everything out of the emptiest pages and into the fullest ones.
+// the emptied pages go on `evacuated`: they can't be freed
+// until every reference to what was in them has been fixed
+static void compactSpace(ObjSpace* space, Page** evacuated) {
+    int pageCount = 0;
+    int cells = 0, live = 0;
+    for(Page* page = space->pages; page != NULL; page = page->next) {
+        pageCount++;
+        cells += page->cellCount;
+        live += page->liveCount;
+    } 
+    if(pageCount < 2) return;
+    int needed = (live + space->pages->cellCount - 1) / space->pages->cellCount;
+    if(needed == pageCount) return;
+    if((size_t) (cells - live) * 100 <= (size_t) cells * vm.gcCompactThreshold) return;
+
+    Page** pages = (Page**) malloc(sizeof(Page*) * pageCount);
+    if(pages == NULL) outOfMemory();
+    int count = 0;
+    for(Page* page = space->pages; page != NULL; page = page->next)
+        pages[count++] = page;
+    qsort(pages, pageCount, sizeof(Page*), compareLiveCounts);
+
+    // the fullest pages stay, and have room for everything in the rest
+    space->pages = NULL;
+    space->lastPage = NULL;
+    for(int i = 0; i < pageCount; i++) {
+        pages[i]->next = NULL;
+        if(i >= needed) continue;
+        if(space->lastPage == NULL) space->pages = pages[i];
+        else space->lastPage->next = pages[i];
+        space->lastPage = pages[i];
+    } 
+    space->allocPage = space->pages;
+
+    for(int i = needed; i < pageCount; i++) {
+        Page* page = pages[i];
+        for(int j = 0; j < page->cellCount; j++) {
+            Obj* object = PAGE_CELL(page, j);
+            if(object->isOld) moveObject(object);
+        } 
+        page->next = *evacuated;
+        *evacuated = page;
+    } 
+    free(pages);
+} 
+
+// runs at the end of a cycle, right after a minor collection:
+// there are no young objects, and nothing is gray or remembered
+static void compactHeap() {
+    if(vm.gcCompactThreshold <= 0) return;
+    Page* evacuated = NULL;
+    for(int sizeClass = 0; sizeClass < OBJECT_CLASS_COUNT; sizeClass++)
+        compactSpace(&vm.spaces[sizeClass], &evacuated);
+    if(evacuated == NULL) return;
+
+    // everything that could point at a moved object goes through the
+    // same fixing up as a minor collection, which also follows forwarded old objects
+    evacuateRoots();
+    evacuateTable(&vm.strings);
+    for(int sizeClass = 0; sizeClass < OBJECT_CLASS_COUNT; sizeClass++) {
+        for(Page* page = vm.spaces[sizeClass].pages; page != NULL; page = page->next) {
+            for(int i = 0; i < page->cellCount; i++) {
+                Obj* object = PAGE_CELL(page, i);
+                if(object->isOld) scanObject(object);
+            } 
+        } 
+    } 
+    for(int i = 0; i < vm.frozenRootCount; i++)
+        scanObject(vm.frozenRoots[i]);
+
+    int pages = 0;
+    while(evacuated != NULL) {
+        Page* next = evacuated->next;
+        // its objects were counted again when they were moved
+        vm.bytesAllocated -= (size_t) evacuated->liveCount * evacuated->cellSize;
+        freePage(evacuated);
+        pages++;
+        evacuated = next;
+    } 
+    vm.gcBytesCompacted += (size_t) pages * PAGE_SIZE;
+
+#ifdef DEBUG_LOG_GC
+    printf("   compacted: %d pages (%zu bytes) reclaimed\n", pages, (size_t) pages * PAGE_SIZE);
+#endif
+} 
+
+static void finishCycle() {
+    compactHeap();
+    for(int sizeClass = 0; sizeClass < OBJECT_CLASS_COUNT; sizeClass++)
+        freeEmptyPages(&vm.spaces[sizeClass]);
+    vm.gcPhase = GC_IDLE;
+} 
+
+static double now() {
+    return (double) clock() / CLOCKS_PER_SEC;
+} 
+
+// the next cycle starts once the heap is `vm.gcGrowth` times what survived this one.
+// a cycle that found most of the heap still alive got little back for its work,
+// and one that took up too much of the time since the last was too expensive,
+// so either makes the heap grow more before the next one.
+// otherwise the growth drifts back down to the configured factor
+static void adaptThreshold() {
+    double end = now();
+    // of what was there when the cycle started.
+    // (anything allocated since then is never freed by the cycle anyway)
+    double survival = vm.gcCycleStart > vm.gcCycleFreed
+        ? (double) (vm.gcCycleStart - vm.gcCycleFreed) / vm.gcCycleStart : 0;
+    double elapsed = end - vm.gcLastCycleEnd;
+    double overhead = elapsed > 0 ? vm.gcCycleTime / elapsed : 0;
+    if(survival > GC_HIGH_SURVIVAL || overhead > GC_MAX_OVERHEAD) {
+        vm.gcGrowth *= 1.5;
+        if(vm.gcGrowth > vm.gcGrowFactor * GC_MAX_GROWTH_BOOST)
+            vm.gcGrowth = vm.gcGrowFactor * GC_MAX_GROWTH_BOOST;
+    } else {
+        vm.gcGrowth *= 0.75;
+        if(vm.gcGrowth < vm.gcGrowFactor) vm.gcGrowth = vm.gcGrowFactor;
+    } 
+    vm.gcLastCycleEnd = end;
 
-    // threshold adjusted as a multiple of the heap size
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    vm.nextGC = (size_t) (vm.bytesAllocated * vm.gcGrowth);
+    if(vm.nextGC < vm.gcInitialHeap) vm.nextGC = vm.gcInitialHeap;
+    // with a limit, collect more often the closer the heap gets to it
+    if(vm.gcMaxHeap > 0 && vm.nextGC > vm.gcMaxHeap) vm.nextGC = vm.gcMaxHeap;
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
     printf("   collected %zu bytes (from %zu to %zu) next GC at %zu\n",
-           before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+           vm.gcCycleStart > vm.bytesAllocated ? vm.gcCycleStart - vm.bytesAllocated : 0,
+           vm.gcCycleStart, vm.bytesAllocated, vm.nextGC);
+    printf("   %.3fms marking and sweeping, %.0f%% survived, growth now %.2f\n",
+           vm.gcCycleTime * 1000, survival * 100, vm.gcGrowth);
+#endif
+    logCycle(survival);
+} 
+
+// an increment has to keep up with the program: the whole cycle's work is spread
+// over the room the heap has to grow into, in proportion to how much was allocated
+// since the last increment. otherwise the heap just keeps growing while marking catches up.
+// this wins over the pause target
+static int sliceBudget() {
+    size_t room = (size_t) (vm.gcCycleStart * (vm.gcGrowth - 1));
+    if(room < GC_SLICE_BYTES) room = GC_SLICE_BYTES;
+    size_t allocated = vm.bytesAllocated > vm.gcLastSlice ? vm.bytesAllocated - vm.gcLastSlice : 0;
+    vm.gcLastSlice = vm.bytesAllocated;
+    double paced = (double) vm.gcCycleWork * allocated / room;
+    if(paced > INT_MAX / 4) paced = INT_MAX / 4;
+    return paced > vm.gcSliceBudget ? (int) paced : vm.gcSliceBudget;
+} 
+
+// sizes the increments so that a whole pause, minor collection included,
+// comes in around `vm.gcTargetPause`, going by how long `work` units just took
+static void adaptSliceBudget(int work, double majorTime, double minorTime) {
+    if(work < GC_MIN_SLICE || majorTime <= 0) return; // too little to go on
+    double room = vm.gcTargetPause - minorTime;
+    double budget = room > 0 ? room * work / majorTime : GC_MIN_SLICE;
+    if(budget < GC_MIN_SLICE) budget = GC_MIN_SLICE;
+    if(budget > INT_MAX / 4) budget = INT_MAX / 4;
+    // averaged with the old one, since `clock` is coarse and slices vary
+    vm.gcSliceBudget = (int) ((vm.gcSliceBudget + budget) / 2);
+} 
+
+static double recordPause(clock_t start) {
+    double pause = (double) (clock() - start) / CLOCKS_PER_SEC;
+    vm.gcPauses++;
+    vm.gcPauseTotal += pause;
+    if(pause > vm.gcPauseMax) vm.gcPauseMax = pause;
+
+#ifdef DEBUG_LOG_GC
+    printf("   paused %.3fms\n", pause * 1000);
+#endif
+    return pause;
+} 
+
+// finishes whatever cycle is underway all at once, or does a whole one if there isn't one
+static void completeCycle(GCTrigger trigger) {
+    clock_t start = clock();
+    if(vm.gcPhase == GC_IDLE) startCycle(trigger);
+    if(vm.gcPhase == GC_MARKING) {
+#ifdef GC_CONCURRENT
+        stopMarker();
+#endif
+        finishMarking();
+    } 
+    clock_t markEnd = clock();
+    int work = INT_MAX;
+    sweepSlice(&work);
+    finishCycle();
+    clock_t end = clock();
+    vm.gcMarkTime += (double) (markEnd - start) / CLOCKS_PER_SEC;
+    vm.gcSweepTime += (double) (end - markEnd) / CLOCKS_PER_SEC;
+    vm.gcCycleTime += (double) (end - start) / CLOCKS_PER_SEC;
+    adaptThreshold();
+} 
+
+// what `tryReallocate` turned down counts too: it's what the program was about to have
+static inline bool overLimit() {
+    return vm.gcMaxHeap > 0 && vm.bytesAllocated + vm.refusedBytes > vm.gcMaxHeap;
+} 
+
+// finishes whatever cycle is underway all at once.
+// anything allocated while that one was running can't be freed by it,
+// so if that wasn't enough, this does a whole cycle on top
+static void collectEverything() {
+    for(int cycle = 0; cycle < 2; cycle++) {
+        completeCycle(GC_TRIGGER_LIMIT);
+        if(!overLimit()) return;
+    } 
+} 
+
+// only ever called from the safepoint in `run`:
+// no C code is in the middle of using an object there,
+// which is what lets a minor collection move young objects.
+// every call does a minor collection and, if one is underway,
+// an increment of the major collection of the old generation
+void collectGarbage() {
+    vm.gcRequested = false;
+    // nothing gets collected in the middle of a request scope:
+    // most of what it makes is garbage by the end, and all of that goes at once
+    if(vm.scopeOpen) {
+        if(overLimit()) vm.heapExhausted = true;
+        vm.refusedBytes = 0;
+        return;
+    } 
+    clock_t start = clock();
+    GCTrigger trigger = vm.gcTrigger;
+    GCPhase phase = vm.gcPhase;
+    size_t before = vm.bytesAllocated;
+    if(vm.freezeRequested) {
+        vm.freezeRequested = false;
+        freezeObjects();
+        logPause(GC_TRIGGER_FREEZE, phase, before, 0, 0, 0, 0, recordPause(start));
+        return;
+    } 
+    lockHeap();
+    int promoted = collectYoung();
+    unlockHeap();
+    clock_t minorEnd = clock();
+    double minorTime = (double) (minorEnd - start) / CLOCKS_PER_SEC;
+
+    if(vm.gcPhase == GC_IDLE) {
+#ifndef DEBUG_STRESS_GC
+        // only go through the old generation when it has actually grown
+        if(vm.bytesAllocated <= vm.nextGC && !overLimit()) {
+            logPause(trigger, phase, before, promoted, minorTime, 0, 0, recordPause(start));
+            return;
+        } 
+        startCycle(GC_TRIGGER_HEAP);
+#else
+        startCycle(vm.bytesAllocated > vm.nextGC ? GC_TRIGGER_HEAP : GC_TRIGGER_STRESS);
+#endif
+    } 
+
+    // everything that was just promoted is gray too,
+    // so do at least that much more to make sure the cycle ends
+    clock_t majorStart = clock();
+    int budget = vm.gcSliceBudget > 0 ? sliceBudget() + promoted : INT_MAX;
+    int work = budget;
+#ifdef GC_CONCURRENT
+    if(vm.gcPhase == GC_MARKING && markerFinished())
+        finishMarking();
+#else
+    if(vm.gcPhase == GC_MARKING && markSlice(&work))
+        finishMarking();
+#endif
+    clock_t markEnd = clock();
+    bool finished = vm.gcPhase == GC_SWEEPING && sweepSlice(&work);
+    if(finished) finishCycle();
+
+    clock_t majorEnd = clock();
+    double majorTime = (double) (majorEnd - majorStart) / CLOCKS_PER_SEC;
+    // (starting a cycle scans the roots, which counts as marking)
+    double markTime = (double) (markEnd - minorEnd) / CLOCKS_PER_SEC;
+    double sweepTime = (double) (majorEnd - markEnd) / CLOCKS_PER_SEC;
+    vm.gcCycleTime += markTime + sweepTime;
+    vm.gcMarkTime += markTime;
+    vm.gcSweepTime += sweepTime;
+    if(finished) {
+        adaptThreshold();
+    } else {
+        // keep the increments coming until this cycle is done
+        vm.nextGC = vm.bytesAllocated + GC_SLICE_BYTES;
+    } 
+    if(vm.gcTargetPause > 0 && vm.gcSliceBudget > 0)
+        adaptSliceBudget(budget - work, majorTime, (double) (majorStart - start) / CLOCKS_PER_SEC);
+
+    // over the limit: one last try before the program gets an error
+    if(overLimit()) {
+        collectEverything();
+        if(overLimit()) vm.heapExhausted = true;
+    } 
+    vm.refusedBytes = 0;
+
+    logPause(trigger, phase, before, promoted, minorTime, markTime, sweepTime, recordPause(start));
+} 
+
+// moves everything still alive into the immortal region, for good (see `freezeHeap`).
+// after a full collection the nursery is empty and every live object is in `vm.spaces`,
+// so those are all copied over and every reference to them fixed up,
+// like compaction does, and then the old generation is empty
+void freezeObjects() {
+    lockHeap();
+    collectYoung();
+    unlockHeap();
+    completeCycle(GC_TRIGGER_FREEZE);
+    // the one that was underway might have missed something that died since it began
+    completeCycle(GC_TRIGGER_FREEZE);
+
+    int count = 0;
+    int capacity = 0;
+    Obj** frozen = NULL;
+    for(int sizeClass = 0; sizeClass < OBJECT_CLASS_COUNT; sizeClass++) {
+        for(Page* page = vm.spaces[sizeClass].pages; page != NULL; page = page->next) {
+            for(int i = 0; i < page->cellCount; i++) {
+                Obj* object = PAGE_CELL(page, i);
+                if(!object->isOld) continue;
+                Obj* copy = forwardObject(object, (Obj*) allocateImmortal(objectSize(object)));
+                copy->isFrozen = true;
+                if(capacity < count + 1) {
+                    capacity = GROW_CAPACITY(capacity);
+                    frozen = (Obj**) realloc(frozen, sizeof(Obj*) * capacity);
+                    if(frozen == NULL) outOfMemory();
+                } 
+                frozen[count++] = copy;
+            } 
+        } 
+    } 
+
+    evacuateRoots();
+    evacuateTable(&vm.strings);
+    for(int i = 0; i < count; i++)
+        scanObject(frozen[i]);
+    // nothing is left written since an earlier freeze: it's all frozen now
+    for(int i = 0; i < vm.frozenRootCount; i++) {
+        vm.frozenRoots[i]->isFrozenRoot = false;
+        scanObject(vm.frozenRoots[i]);
+    } 
+    vm.frozenRootCount = 0;
+    free(frozen);
+    vm.mortalNames = false;
+
+    for(int sizeClass = 0; sizeClass < OBJECT_CLASS_COUNT; sizeClass++) {
+        ObjSpace* space = &vm.spaces[sizeClass];
+        Page* page = space->pages;
+        while(page != NULL) {
+            Page* next = page->next;
+            // its objects were counted again when they were copied
+            vm.bytesAllocated -= (size_t) page->liveCount * page->cellSize;
+            freePage(page);
+            page = next;
+        } 
+        space->pages = NULL;
+        space->lastPage = NULL;
+        space->allocPage = NULL;
+        space->sweepPage = NULL;
+    } 
+
+    // and a worker forked after this shouldn't start out writing into anything the parent
+    // already had: the nursery's empty chunk, the collector's stacks, the free cells
+    // between the buffers in the buffer pages (which are given up: new buffers go in new pages),
+    // or the last immortal page (new immortal objects start one of their own)
+    free(vm.nursery);
+    vm.nursery = NULL;
+    free(vm.grayStack);
+    vm.grayStack = NULL;
+    vm.grayCapacity = 0;
+    free(vm.remembered);
+    vm.remembered = NULL;
+    vm.rememberedCapacity = 0;
+    free(vm.weakObjects);
+    vm.weakObjects = NULL;
+    vm.weakCapacity = 0;
+    free(vm.frozenRoots);
+    vm.frozenRoots = NULL;
+    vm.frozenRootCapacity = 0;
+    for(int sizeClass = 0; sizeClass < SIZE_CLASS_COUNT; sizeClass++)
+        vm.freeBuffers[sizeClass] = NULL;
+    if(vm.immortalPages != NULL) vm.immortalTop = (char*) vm.immortalPages + PAGE_SIZE;
+#ifdef __GLIBC__
+    // otherwise what was just freed stays with malloc, and a worker forked after this
+    // copies each page of it as soon as it puts something new there
+    malloc_trim(0);
+#endif
+
+    // what was frozen counts towards the heap's size, but not towards when to collect it
+    vm.nextGC = vm.bytesAllocated + vm.gcInitialHeap;
+    vm.gcLastSlice = vm.bytesAllocated;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- froze %d objects, %zu bytes immortal\n", count, vm.immortalBytes);
 #endif
 } 
 
+// the ways to change a setting: `--gc-<name>=<value>` on the command line,
+// or the environment variable
+typedef struct {
+    const char* name;
+    const char* variable;
+} GCOption;
+
+static const GCOption gcOptions[] = {
+    {"initial-heap", "CLOX_GC_INITIAL_HEAP"},
+    {"growth", "CLOX_GC_GROWTH"},
+    {"max-heap", "CLOX_GC_MAX_HEAP"},
+    {"pause", "CLOX_GC_PAUSE"},
+    {"compact", "CLOX_GC_COMPACT"},
+    {"log", "CLOX_GC_LOG"},
+};
+
+// a number of bytes, optionally followed by k, m or g
+bool parseSize(const char* text, size_t* size) {
+    char* end;
+    double value = strtod(text, &end);
+    if(end == text || value < 0) return false;
+    switch(*end) {
+        case 'k': case 'K': value *= 1024; end++; break;
+        case 'm': case 'M': value *= 1024 * 1024; end++; break;
+        case 'g': case 'G': value *= 1024.0 * 1024 * 1024; end++; break;
+    } 
+    if(*end != '\0') return false;
+    *size = (size_t) value;
+    return true;
+} 
+
+static bool parseNumber(const char* text, double* number) {
+    char* end;
+    *number = strtod(text, &end);
+    return end != text && *end == '\0';
+} 
+
+// returns `false` for an unknown setting or a bad value
+bool setGCOption(const char* name, const char* value) {
+    if(strcmp(name, "initial-heap") == 0) {
+        if(!parseSize(value, &vm.gcInitialHeap)) return false;
+        vm.nextGC = vm.gcInitialHeap;
+        return true;
+    } 
+    if(strcmp(name, "growth") == 0) {
+        double growth;
+        if(!parseNumber(value, &growth) || growth <= 1) return false;
+        vm.gcGrowFactor = growth;
+        vm.gcGrowth = growth;
+        return true;
+    } 
+    if(strcmp(name, "max-heap") == 0)
+        return parseSize(value, &vm.gcMaxHeap);
+    if(strcmp(name, "pause") == 0) {
+        // in milliseconds
+        double pause;
+        if(!parseNumber(value, &pause) || pause < 0) return false;
+        vm.gcTargetPause = pause / 1000;
+        // a target only makes sense with increments to size
+        if(vm.gcTargetPause > 0 && vm.gcSliceBudget == 0) vm.gcSliceBudget = GC_MIN_SLICE;
+        return true;
+    } 
+    if(strcmp(name, "compact") == 0) {
+        // a percentage, as in `GC_COMPACT_THRESHOLD`
+        double threshold;
+        if(!parseNumber(value, &threshold) || threshold < 0 || threshold > 100) return false;
+        vm.gcCompactThreshold = (int) threshold;
+        return true;
+    } 
+    if(strcmp(name, "log") == 0) {
+        // a file descriptor that's already open (see gclog.h)
+        double fd;
+        if(!parseNumber(value, &fd) || fd < 0 || fd != (int) fd) return false;
+        vm.gcLogFd = (int) fd;
+        return true;
+    } 
+    return false;
+} 
+
+// the defaults, then whatever the environment overrides
+void configureGC() {
+    vm.gcInitialHeap = GC_INITIAL_HEAP;
+    vm.gcGrowFactor = GC_HEAP_GROW_FACTOR;
+    vm.gcMaxHeap = GC_MAX_HEAP;
+    vm.gcTargetPause = GC_TARGET_PAUSE;
+    vm.gcGrowth = vm.gcGrowFactor;
+    vm.gcCycleTime = 0;
+    vm.gcCycleFreed = 0;
+    vm.gcCycleWork = 0;
+    vm.gcLastSlice = 0;
+    vm.gcLastCycleEnd = now();
+    vm.nextGC = vm.gcInitialHeap;
+    vm.gcLogFd = -1;
+
+    for(size_t i = 0; i < sizeof(gcOptions) / sizeof(gcOptions[0]); i++) {
+        const char* value = getenv(gcOptions[i].variable);
+        if(value != NULL && !setGCOption(gcOptions[i].name, value))
+            fprintf(stderr, "Ignoring bad value of %s.\n", gcOptions[i].variable);
+    } 
+} 
+
 void freeObjects() {
-	Obj* object = vm.objects;
-	while(object != NULL) {
-		Obj* next = object-> next;
-		freeObject(object);
-		object = next;
-	} 
+#ifdef DEBUG_LOG_GC
+    if(vm.gcPauses > 0)
+        printf("-- %d gc pauses, %.3fms max, %.3fms average\n", vm.gcPauses,
+               vm.gcPauseMax * 1000, vm.gcPauseTotal * 1000 / vm.gcPauses);
+    if(vm.gcBytesCompacted > 0)
+        printf("-- compaction reclaimed %zu bytes\n", vm.gcBytesCompacted);
+    printf("-- %zu bytes immortal\n", vm.immortalBytes);
+#endif
+#ifdef GC_CONCURRENT
+    stopMarker();
+#endif
+    for(int sizeClass = 0; sizeClass < OBJECT_CLASS_COUNT; sizeClass++) {
+        Page* page = vm.spaces[sizeClass].pages;
+        while(page != NULL) {
+            for(int i = 0; i < page->cellCount; i++) {
+                Obj* object = PAGE_CELL(page, i);
+                if(object->isOld) freeContents(object);
+            } 
+            Page* next = page->next;
+            freePage(page);
+            page = next;
+        } 
+    } 
+
+    Page* page = vm.immortalPages;
+    while(page != NULL) {
+        char* cursor = (char*) (page + 1);
+        for(int i = 0; i < page->cellCount; i++) {
+            Obj* object = (Obj*) cursor;
+            cursor += ALIGN_OBJECT(objectSize(object));
+            freeContents(object);
+        } 
+        Page* next = page->next;
+        freePage(page);
+        page = next;
+    } 
+    vm.immortalPages = NULL;
+
+    // or the arena of a request scope that was never ended
+    if(vm.arena != NULL) releaseArena(false);
+
+    // nothing in the nursery survives this
+    NurseryChunk* chunk = vm.nursery;
+    while(chunk != NULL) {
+        char* start = (char*) (chunk + 1);
+        for(char* cursor = start; cursor < start + chunk->used; ) {
+            Obj* young = (Obj*) cursor;
+            cursor += ALIGN_OBJECT(objectSize(young));
+            freeContents(young);
+        } 
+        NurseryChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    } 
+    vm.nursery = NULL;
+
+    page = vm.bufferPages;
+    while(page != NULL) {
+        Page* next = page->next;
+        freePage(page);
+        page = next;
+    } 
+    vm.bufferPages = NULL;
+    for(int sizeClass = 0; sizeClass < SIZE_CLASS_COUNT; sizeClass++)
+        vm.freeBuffers[sizeClass] = NULL;
+
     free(vm.grayStack);
+    free(vm.remembered);
+    free(vm.weakObjects);
+    free(vm.frozenRoots);
+    freeAllocationSites();
+    freeAllocationProfile();
+    logSummary();
 } 
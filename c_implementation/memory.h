@@ -3,12 +3,17 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count) \
 	(type*) reallocate(NULL, 0, sizeof(type) * (count))
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+// NULL rather than going over the heap limit (see `tryReallocate`)
+#define TRY_ALLOCATE(type, count) \
+	(type*) tryReallocate(NULL, 0, sizeof(type) * (count))
+
 // this is a macro function. use \ to do newlines in one.
 // I'm fairly certain macros treat things as if you transplanted them there,
 // so you need parentheses around literally everything.
@@ -23,10 +28,133 @@
 #define FREE_ARRAY(type, pointer, count) \
 	reallocate(pointer, sizeof(type) * (count), 0)
 
+// a slab: a page of same-sized cells, one of the size classes.
+// the old generation lives in these, and a cell of theirs that isn't `isOld`
+// is free and linked to the next free one through `next`.
+// small buffers get their own pages, which are never swept,
+// and so do immortal objects (see `allocateImmortal`)
+#define PAGE_SIZE (64 * 1024)
+
+struct Page {
+    struct Page* next;
+    int cellSize;
+    int cellCount;
+    int liveCount;
+    bool needsSweep; // this cycle's marks are in, but the dead cells haven't been freed
+    Obj* freeCells;
+    // the mark bits of the cells, one per 8 bytes of the page.
+    // marking never has to write to the objects themselves,
+    // and sweeping a page clears all of its marks at once
+    uint64_t marks[PAGE_SIZE / 8 / 64];
+    // the cells follow
+};
+
+// the rest of a free cell, or of a young object that has been copied out, is dead.
+// its first 8-byte word after the header links it to the next free cell
+// or holds its new address
+#define OBJ_LINK(object) (((Obj**) (object))[1])
+
+// pages are aligned to their size, so this works for any old object
+#define PAGE_OF(object) \
+    ((Page*) ((uintptr_t) (object) & ~(uintptr_t) (PAGE_SIZE - 1)))
+#define MARK_INDEX(object) (((uintptr_t) (object) & (PAGE_SIZE - 1)) / 8)
+
+// how many objects a major collection marks or sweeps per increment
+// 0 does the whole collection in one pause
+#define GC_SLICE_BUDGET 1000
+
+// defaults for the settings `configureGC` reads from the environment
+// (and the command line can change with `setGCOption`)
+#define GC_INITIAL_HEAP (1024 * 1024) // the first major collection, and the least the heap gets
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_MAX_HEAP 0 // in bytes, 0 for no limit
+#define GC_TARGET_PAUSE 0 // in seconds. 0 keeps the slice budget as it is
+
+// after a major collection, a size class whose pages are more than this percent
+// free cells gets compacted into as few pages as it needs. 0 never compacts
+#define GC_COMPACT_THRESHOLD 50
+
+// young objects are never marked
+static inline bool isMarked(Obj* object) {
+    if(!object->isOld) return false;
+    size_t index = MARK_INDEX(object);
+    return (PAGE_OF(object)->marks[index / 64] >> (index % 64)) & 1;
+} 
+
+static inline void setMarked(Obj* object) {
+    size_t index = MARK_INDEX(object);
+    PAGE_OF(object)->marks[index / 64] |= (uint64_t) 1 << (index % 64);
+} 
+
+// immortal pages hold objects of any size, so they have no cell size
+static inline bool isImmortal(Obj* object) {
+    return object->isOld && PAGE_OF(object)->cellSize == 0;
+} 
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void* tryReallocate(void* pointer, size_t oldSize, size_t newSize);
+void* allocateYoung(size_t size);
+void* allocateImmortal(size_t size);
+void* allocateScoped(size_t size);
+void releaseArena(bool escaped);
 void markObject(Obj* object);
 void markValue(Value value);
+Obj* evacuateObject(Obj* object);
+void evacuateValue(Value* slot);
+void rememberObject(Obj* object);
+void rememberFrozen(Obj* object);
+void writeBarrierAll(Obj* object);
+#ifdef GC_CONCURRENT
+void lockHeap();
+void unlockHeap();
+#else
+#define lockHeap()
+#define unlockHeap()
+#endif
 void collectGarbage();
+void freezeObjects();
+void configureGC();
+bool setGCOption(const char* name, const char* value);
+bool parseSize(const char* text, size_t* size);
 void freeObjects();
 
+// an object from the open request scope being stored somewhere older than the scope
+// means the scope's arena can't just be thrown away at the end (see `releaseArena`)
+static inline void checkEscape(bool intoScoped, Value value) {
+    if(vm.scopeOpen && !intoScoped && IS_OBJ(value) && AS_OBJ(value)->isScoped)
+        vm.scopeEscaped = true;
+} 
+
+// has to run before `value` is stored into a field of `object`.
+// minor collections only look at old objects that were written this way,
+// so an old object pointing at a young one it never told us about
+// would be left pointing at garbage.
+// same goes for an already-marked object being handed a white one
+// while a major collection is marking in increments
+static inline void writeBarrier(Obj* object, Value value) {
+    checkEscape(object->isScoped, value);
+    if(!object->isOld || !IS_OBJ(value)) return;
+    // the same goes for a frozen object, which nothing traces otherwise
+    if(object->isFrozen && !object->isFrozenRoot) rememberFrozen(object);
+    Obj* target = AS_OBJ(value);
+    if(!target->isOld)
+        rememberObject(object);
+#ifndef GC_CONCURRENT
+    else if(vm.gcPhase == GC_MARKING && isMarked(object))
+        markObject(target);
+#endif
+} 
+
+// the background marker uses the other kind of barrier, snapshot-at-the-beginning:
+// everything reachable when marking started gets marked,
+// so whatever a field held has to be logged (grayed) before it's overwritten.
+// only call with the heap locked
+static inline void snapshotBarrier(Value old) {
+#ifdef GC_CONCURRENT
+    if(vm.markerActive && IS_OBJ(old)) markObject(AS_OBJ(old));
+#else
+    (void) old;
+#endif
+} 
+
 #endif
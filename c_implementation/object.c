@@ -1,11 +1,15 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "hash.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
 #include "vm.h"
 #include "table.h"
+#include "snapshot.h"
+#include "profile.h"
 
 #define ALLOCATE_OBJ(type, objectType) \
 	(type*) allocateObject(sizeof(type), objectType)
@@ -17,12 +21,25 @@
 // we allocate space for the "outer" type and then
 // assign this one's fields; the "outer" fields are assigned separately
 static Obj* allocateObject(size_t size, ObjType type) {
-	Obj* object = (Obj*)reallocate(NULL, 0, size);
+	// everything starts out young; only survivors make it to `vm.spaces`.
+	// apart from the main script's code, which is old (and alive) from the start,
+	// and what a request makes, which stays in its arena until the request is over
+    bool immortal = vm.immortalAllocation;
+    bool scoped = !immortal && !vm.youngAllocation && vm.scopeOpen;
+    Obj* object;
+    if(immortal) object = (Obj*) allocateImmortal(size);
+    else if(scoped) object = (Obj*) allocateScoped(size);
+    else object = (Obj*) allocateYoung(size);
 	object->type = type;
-    object->isMarked = false;
-	// insert at the head
-	object->next = vm.objects;
-	vm.objects = object;
+    object->isOld = immortal;
+    object->isRemembered = false;
+    object->isForwarded = false;
+    object->isScoped = scoped;
+    object->isFrozen = false;
+    object->isFrozenRoot = false;
+    vm.objectsAllocated[type]++;
+    if(vm.trackAllocations) trackAllocation(object);
+    if(vm.sampleAllocations) sampleAllocation(size);
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*) object, size, type);
@@ -31,6 +48,23 @@ static Obj* allocateObject(size_t size, ObjType type) {
 	return object;
 } 
 
+ObjWeakRef* newWeakRef(Value target) {
+    ObjWeakRef* ref = ALLOCATE_OBJ(ObjWeakRef, OBJ_WEAK_REF);
+    ref->target = target;
+    return ref;
+} 
+
+ObjWeakTable* newWeakTable(bool weakKeys, bool weakValues) {
+    ObjWeakTable* table = ALLOCATE_OBJ(ObjWeakTable, OBJ_WEAK_TABLE);
+    table->weakKeys = weakKeys;
+    table->weakValues = weakValues;
+    table->count = 0;
+    table->tombstones = 0;
+    table->capacity = 0;
+    table->entries = NULL;
+    return table;
+} 
+
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
     ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->receiver = receiver;
@@ -53,17 +87,14 @@ ObjClass* newClass(ObjString* name) {
 } 
 
 ObjClosure* newClosure(ObjFunction* function) {
-    // we know exactly how big the array needs to be
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
-    // this is important for the garbage collector (it shouldn't see uninitialized memory)
-    for(int i = 0; i < function->upvalueCount; i++)
-        upvalues[i] = NULL;
-
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    // we know exactly how big the array needs to be, so it goes right after the closure
+    ObjClosure* closure = (ObjClosure*) allocateObject(
+        sizeof(ObjClosure) + sizeof(ObjUpvalue*) * function->upvalueCount, OBJ_CLOSURE);
     closure->function = function;
-    // closures own the array containing pointers to the upvalues
-    closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
+    // this is important for the garbage collector (it shouldn't see uninitialized memory)
+    for(int i = 0; i < function->upvalueCount; i++)
+        closure->upvalues[i] = NULL;
     return closure;
 } 
 
@@ -73,6 +104,7 @@ ObjFunction* newFunction() {
     function->arity = 0;
     function->upvalueCount = 0;
     function->name = NULL;
+    function->closure = NULL;
     initChunk(&function->chunk);
     return function;
 } 
@@ -100,20 +132,42 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash) {
 	string->length = length;
 	string->chars = chars;
 	string->hash = hash;
+    string->isInterned = true;
+    string->left = NULL;
+    string->right = NULL;
     push(OBJ_VAL(string));
 	tableSet(&vm.strings, string, NIL_VAL);
     pop();
 	return string;
 }
 
-// the actual hash function
-static uint32_t hashString(const char* key, int length) {
-	uint32_t hash = 2166136261u;
-	for(int i = 0; i < length; i++) {
-		hash ^= (uint8_t) key[i];
-		hash *= 16777619;
+// a long string that is most likely only going to be printed:
+// no hashing and no trip through the intern table until it's used as a key
+static ObjString* allocateTransientString(char* chars, int length) {
+	ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+	string->length = length;
+	string->chars = chars;
+	string->hash = 0; // computed by `internString`, if ever
+    string->isInterned = false;
+    string->left = NULL;
+    string->right = NULL;
+	return string;
+}
+
+// the interned string with these characters, if any.
+// immortal objects can only point at each other, so while the main script is compiled
+// a mortal one is uninterned, and likewise one in a request's arena when the compiler
+// wants a name that outlives the request (see `vm.youngAllocation`).
+// it still compares equal by its characters, and the compiler makes a copy of its own
+static ObjString* findInterned(const char* chars, int length, uint32_t hash) {
+	ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+	if(interned != NULL && ((vm.immortalAllocation && !isImmortal((Obj*) interned)) ||
+	        (vm.youngAllocation && interned->obj.isScoped))) {
+		tableDelete(&vm.strings, interned);
+		interned->isInterned = false;
+		return NULL;
 	} 
-	return hash;
+	return interned;
 } 
 
 // allows taking ownership of the chars immediately
@@ -121,8 +175,9 @@ static uint32_t hashString(const char* key, int length) {
 // need to allocate new object, though
 // also need to free the memory string passed in and don't need the duplicate
 ObjString* takeString(char* chars, int length) {
+	if(length >= TRANSIENT_MIN_LENGTH) return allocateTransientString(chars, length);
 	uint32_t hash = hashString(chars, length);
-	ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+	ObjString* interned = findInterned(chars, length, hash);
 	if(interned != NULL) {
 		FREE_ARRAY(char, chars, length + 1);
 		return interned;
@@ -132,15 +187,19 @@ ObjString* takeString(char* chars, int length) {
 
 // no string ownership anymore, as everything is stored in the same struct
 ObjString* copyString(const char* chars, int length) {
-	uint32_t hash = hashString(chars, length);
-	// if the string already is interned we just return that one
-	ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-	if(interned != NULL) return interned;
+	uint32_t hash = 0;
+	if(length < TRANSIENT_MIN_LENGTH) {
+		hash = hashString(chars, length);
+		// if the string already is interned we just return that one
+		ObjString* interned = findInterned(chars, length, hash);
+		if(interned != NULL) return interned;
+	} 
 	char* heapChars = ALLOCATE(char, length + 1);
 	memcpy(heapChars, chars, length);
 	// have to terminate this ourselves
 	// lexeme points at a range of characters
 	heapChars[length] = '\0';
+	if(length >= TRANSIENT_MIN_LENGTH) return allocateTransientString(heapChars, length);
 	return allocateString(heapChars, length, hash);
 
 /*
@@ -152,11 +211,140 @@ ObjString* copyString(const char* chars, int length) {
 */
 } 
 
+// the interned string with the same characters as `string`.
+// if there isn't one yet, `string` itself becomes the interned copy.
+// tables call this on any key that isn't interned, since they compare keys by pointer
+ObjString* internString(ObjString* string) {
+	if(string->isInterned) return string;
+
+	push(OBJ_VAL(string));
+	flattenString(string);
+	string->hash = hashString(string->chars, string->length);
+	ObjString* interned = findInterned(string->chars, string->length, string->hash);
+	if(interned == NULL) {
+		string->isInterned = true;
+		tableSet(&vm.strings, string, NIL_VAL);
+		interned = string;
+	} 
+	pop();
+	return interned;
+} 
+
+// a lazy concatenation: nothing is copied, hashed, or interned until
+// something actually needs the characters (see `flattenString`)
+// both halves must be reachable by the GC when this is called
+ObjString* newRope(ObjString* left, ObjString* right) {
+    ObjString* rope = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    rope->length = left->length + right->length;
+    rope->isInterned = false;
+    rope->hash = 0;
+    rope->chars = NULL;
+    rope->left = left;
+    rope->right = right;
+    return rope;
+} 
+
+// visits the flat pieces of a rope from left to right.
+// a string built up in a loop is a rope as deep as the loop ran,
+// so this keeps its own stack rather than recursing.
+// uses `realloc` directly, like the gray stack, so it never triggers a GC
+static void forEachRopeLeaf(ObjString* rope,
+        void (*visit)(ObjString* leaf, void* context), void* context) {
+    int capacity = 8;
+    int count = 0;
+    ObjString** stack = (ObjString**) malloc(sizeof(ObjString*) * capacity);
+    if(stack == NULL) exit(1);
+
+    stack[count++] = rope;
+    while(count > 0) {
+        ObjString* node = stack[--count];
+        if(node->chars != NULL) {
+            visit(node, context);
+            continue;
+        } 
+        if(capacity < count + 2) {
+            capacity = GROW_CAPACITY(capacity);
+            stack = (ObjString**) realloc(stack, sizeof(ObjString*) * capacity);
+            if(stack == NULL) exit(1);
+        } 
+        // right goes on first so the left half comes off first
+        stack[count++] = node->right;
+        stack[count++] = node->left;
+    } 
+    free(stack);
+} 
+
+static void copyLeaf(ObjString* leaf, void* context) {
+    char** cursor = (char**) context;
+    memcpy(*cursor, leaf->chars, leaf->length);
+    *cursor += leaf->length;
+} 
+
+static void printLeaf(ObjString* leaf, void* context) {
+    (void) context;
+    fwrite(leaf->chars, sizeof(char), leaf->length, stdout);
+} 
+
+static void joinRope(ObjString* string, char* chars) {
+    char* cursor = chars;
+    forEachRopeLeaf(string, copyLeaf, &cursor);
+    chars[string->length] = '\0';
+    lockHeap();
+    snapshotBarrier(OBJ_VAL(string->left));
+    snapshotBarrier(OBJ_VAL(string->right));
+    string->chars = chars;
+    string->left = NULL;
+    string->right = NULL;
+    unlockHeap();
+} 
+
+// joins a rope into one buffer in place. the result stays uninterned,
+// so the halves can be collected once nothing else points at them
+ObjString* flattenString(ObjString* string) {
+    if(string->chars != NULL) return string;
+    joinRope(string, ALLOCATE(char, string->length + 1));
+    return string;
+} 
+
+// the same, but a rope whose characters would take the heap over its limit
+// (or that the system has no room for) stays a rope, and this returns false.
+// a script can double a string into gigabytes without ever touching them,
+// so anything that flattens one on the script's behalf should go through here
+bool tryFlattenString(ObjString* string) {
+    if(string->chars != NULL) return true;
+    char* chars = TRY_ALLOCATE(char, string->length + 1);
+    if(chars == NULL) return false;
+    joinRope(string, chars);
+    return true;
+} 
+
+// interned strings can be compared by pointer,
+// but anything that came from a rope has to be compared by content
+bool stringsEqual(ObjString* a, ObjString* b) {
+    if(a == b) return true;
+    if(a->length != b->length) return false;
+    if(a->isInterned && b->isInterned) return false;
+
+    // keep both alive while either one is flattened
+    push(OBJ_VAL(a));
+    push(OBJ_VAL(b));
+    flattenString(a);
+    flattenString(b);
+    pop();
+    pop();
+    return memcmp(a->chars, b->chars, a->length) == 0;
+} 
+
+static void printString(ObjString* string) {
+    if(string->chars != NULL) printf("%s", string->chars);
+    // printing doesn't need the rope to be joined
+    else forEachRopeLeaf(string, printLeaf, NULL);
+} 
+
 ObjUpvalue* newUpvalue(Value* slot) {
     ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
-    upvalue->next = NULL;
     return upvalue;
 } 
 
@@ -191,12 +379,18 @@ void printObject(Value value) {
             printf("<native fn>");
             break;
 		case OBJ_STRING:
-			printf("%s", AS_CSTRING(value));
+			printString(AS_STRING(value));
 			break;
         case OBJ_UPVALUE:
             // shouldn't really be accessible by the user
             printf("upvalue");
             break;
+        case OBJ_WEAK_REF:
+            printf("<weak ref>");
+            break;
+        case OBJ_WEAK_TABLE:
+            printf("<weak table>");
+            break;
 	} 
 } 
 
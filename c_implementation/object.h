@@ -16,6 +16,8 @@
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_WEAK_REF(value) isObjType(value, OBJ_WEAK_REF)
+#define IS_WEAK_TABLE(value) isObjType(value, OBJ_WEAK_TABLE)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
@@ -24,7 +26,14 @@
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 #define AS_NATIVE(value) ((ObjNative*)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
-#define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
+#define AS_WEAK_REF(value) ((ObjWeakRef*)AS_OBJ(value))
+#define AS_WEAK_TABLE(value) ((ObjWeakTable*)AS_OBJ(value))
+#define AS_CSTRING(value) (flattenString((ObjString*)AS_OBJ(value))->chars)
+
+// concatenations at least this long are kept as ropes instead of being copied
+#define ROPE_MIN_LENGTH 64
+// strings at least this long are not interned (or even hashed) when created
+#define TRANSIENT_MIN_LENGTH 64
 
 typedef enum {
     OBJ_UPVALUE,
@@ -35,13 +44,25 @@ typedef enum {
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
+    OBJ_WEAK_REF,
+    OBJ_WEAK_TABLE,
 } ObjType;
 
-// object "metadata" or "inheritor"
+#define OBJ_TYPE_COUNT (OBJ_WEAK_TABLE + 1)
+
+// object "metadata" or "inheritor".
+// 4 bytes, so a subtype's `int` fields fit in alongside it.
+// mark bits are in the page (see `Page`), and there is no list of every object:
+// the garbage collector walks the nursery and the pages instead
 struct Obj {
-	ObjType type;
-    bool isMarked;
-	struct Obj* next;
+	uint8_t type; // an ObjType
+    bool isOld; // survived a minor collection and now lives in the pages of `vm.spaces`
+    bool isRemembered; // old, but pointing at young objects (see `writeBarrier`)
+    // these only ever change on the main thread, so they can share a byte
+    bool isForwarded : 1; // young and copied out to the address in its first field
+    bool isScoped : 1; // in the arena of the open request scope (see `beginRequestScope`)
+    bool isFrozen : 1; // moved into the immortal region by `freezeHeap`
+    bool isFrozenRoot : 1; // frozen, but written since, so it's in `vm.frozenRoots`
 }; 
 
 typedef struct {
@@ -50,6 +71,8 @@ typedef struct {
     int upvalueCount;
     Chunk chunk;
     ObjString* name;
+    // with no upvalues every closure of it would be the same, so there's just this one
+    struct ObjClosure* closure;
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value* args, bool* wasError);
@@ -60,29 +83,33 @@ typedef struct {
 } ObjNative; 
 
 // string is an array of chars
+// or a rope: the two strings it concatenates, joined only when needed
 struct ObjString {
 	Obj obj;
 	int length; // convenient for not walking the whole string
-	uint32_t hash;
-	char* chars;
+    bool isInterned; // ropes and long strings are only put in `vm.strings` on demand
+	uint32_t hash; // only valid once interned
+	char* chars; // NULL while this is still a rope
+    struct ObjString* left;
+    struct ObjString* right;
 };
 
 typedef struct ObjUpvalue {
     Obj obj; 
     Value* location;
     Value closed;
-    struct ObjUpvalue* next;
 } ObjUpvalue; 
 
-typedef struct {
+typedef struct ObjClosure {
     Obj obj;
-    ObjFunction* function;
-    // dynamic array for the number of upvalues
-    ObjUpvalue** upvalues;
     // technically redundant because `function` holds this info
     // however, this is for the garbage collector:
-    // it might need to know this after `function` has been freed
+    // it might need to know this after `function` has been freed.
+    // it comes first so a closure that's been copied out still has it (see `OBJ_LINK`)
     int upvalueCount;
+    ObjFunction* function;
+    // the upvalues follow the closure, in the same allocation
+    ObjUpvalue* upvalues[];
 } ObjClosure;
 
 typedef struct {
@@ -103,6 +130,28 @@ typedef struct {
     ObjClosure* method;
 } ObjBoundMethod;
 
+// doesn't keep its target alive: once that's collected, this holds nil
+typedef struct {
+    Obj obj;
+    Value target;
+} ObjWeakRef;
+
+typedef struct {
+    Value key; // nil for an empty entry (or a tombstone, if `value` is true)
+    Value value;
+} WeakEntry;
+
+// a hash table whose keys, values, or both don't keep anything alive (see weak.c)
+typedef struct {
+    Obj obj;
+    bool weakKeys;
+    bool weakValues;
+    int count; // live entries only
+    int tombstones;
+    int capacity;
+    WeakEntry* entries;
+} ObjWeakTable;
+
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 ObjInstance* newInstance(ObjClass* klass);
 ObjClass* newClass(ObjString* name);
@@ -111,7 +160,14 @@ ObjFunction* newFunction();
 ObjNative* newNative(NativeFn function);
 ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char* chars, int length); 
+ObjString* internString(ObjString* string);
+ObjString* newRope(ObjString* left, ObjString* right);
+ObjString* flattenString(ObjString* string);
+bool tryFlattenString(ObjString* string);
+bool stringsEqual(ObjString* a, ObjString* b);
 ObjUpvalue* newUpvalue(Value* slot);
+ObjWeakRef* newWeakRef(Value target);
+ObjWeakTable* newWeakTable(bool weakKeys, bool weakValues);
 void printObject(Value value);
 
 // separate function because we need `value` twice,
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "memory.h"
+#include "object.h"
+#include "profile.h"
+#include "vm.h"
+
+// the allocation profiler (`--alloc-profile`). rather than look at every allocation,
+// it stops about once every `sampleRate` bytes and charges everything since the last
+// sample to the allocation that crossed the line, so a site's share of the samples is
+// its share of the bytes. the gaps are jittered so a loop can't line up with them.
+// like the heap snapshots, none of this lives in the garbage-collected heap
+
+// what's been charged to a site ("function:line") or a whole call stack
+typedef struct {
+    char* key; // NULL for an empty slot
+    size_t bytes;
+    size_t objects; // estimated from the bytes and the sampled object's size
+    uint32_t samples;
+} ProfileEntry;
+
+typedef struct {
+    ProfileEntry* entries;
+    uint32_t count;
+    uint32_t capacity;
+} ProfileTable;
+
+static ProfileTable sites;
+static ProfileTable stacks;
+
+static size_t sampleRate = 0;
+static size_t bytesSinceSample = 0;
+static size_t nextSample = 0;
+static uint32_t sampleCount = 0;
+static uint64_t randomState = 0x9e3779b97f4a7c15u;
+
+// the key being put together for a sample
+static char* keyBuffer = NULL;
+static size_t keyLength = 0;
+static size_t keyCapacity = 0;
+
+static void outOfMemory() {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+} 
+
+// xorshift: nothing fancy, it only has to keep the gaps from being regular
+static size_t nextGap() {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+    // somewhere from half the rate to one and a half times it, so it averages out to the rate
+    return sampleRate / 2 + (size_t) (randomState % (sampleRate + 1));
+} 
+
+void startAllocationProfile(size_t rate) {
+    sampleRate = rate == 0 ? 1 : rate;
+    bytesSinceSample = 0;
+    nextSample = nextGap();
+    vm.sampleAllocations = true;
+} 
+
+static ProfileEntry* findEntry(ProfileEntry* entries, uint32_t capacity, const char* key, int length) {
+    uint32_t index = hashString(key, length) & (capacity - 1);
+    for(;;) {
+        ProfileEntry* entry = &entries[index];
+        if(entry->key == NULL || (strncmp(entry->key, key, length) == 0 && entry->key[length] == '\0'))
+            return entry;
+        index = (index + 1) & (capacity - 1);
+    } 
+} 
+
+static ProfileEntry* profileEntry(ProfileTable* table, const char* key, int length) {
+    if(table->capacity * 3 / 4 < table->count + 1) {
+        uint32_t capacity = GROW_CAPACITY(table->capacity);
+        ProfileEntry* entries = (ProfileEntry*) calloc(capacity, sizeof(ProfileEntry));
+        if(entries == NULL) outOfMemory();
+        for(uint32_t i = 0; i < table->capacity; i++) {
+            ProfileEntry* entry = &table->entries[i];
+            if(entry->key == NULL) continue;
+            *findEntry(entries, capacity, entry->key, (int) strlen(entry->key)) = *entry;
+        } 
+        free(table->entries);
+        table->entries = entries;
+        table->capacity = capacity;
+    } 
+
+    ProfileEntry* entry = findEntry(table->entries, table->capacity, key, length);
+    if(entry->key == NULL) {
+        entry->key = strndup(key, length);
+        if(entry->key == NULL) outOfMemory();
+        table->count++;
+    } 
+    return entry;
+} 
+
+static void appendKey(const char* chars, size_t length) {
+    if(keyCapacity < keyLength + length + 1) {
+        while(keyCapacity < keyLength + length + 1) keyCapacity = GROW_CAPACITY(keyCapacity);
+        keyBuffer = (char*) realloc(keyBuffer, keyCapacity);
+        if(keyBuffer == NULL) outOfMemory();
+    } 
+    memcpy(keyBuffer + keyLength, chars, length);
+    keyLength += length;
+    keyBuffer[keyLength] = '\0';
+} 
+
+// "function:line" for where the frame is at
+static void appendFrame(CallFrame* frame) {
+    ObjFunction* function = frame->closure->function;
+    const char* name = function->name == NULL ? "script" : function->name->chars;
+    char line[16];
+    int offset = (int) (frame->ip - function->chunk.code - 1);
+    int length = snprintf(line, sizeof(line), ":%d", getLine(&function->chunk, offset));
+    appendKey(name, strlen(name));
+    appendKey(line, (size_t) length);
+} 
+
+static void charge(ProfileEntry* entry, size_t bytes, size_t objects) {
+    entry->bytes += bytes;
+    entry->objects += objects;
+    entry->samples++;
+} 
+
+static void takeSample(size_t size) {
+    size_t bytes = bytesSinceSample;
+    size_t objects = size == 0 ? 1 : (bytes + size / 2) / size;
+    if(objects == 0) objects = 1;
+    bytesSinceSample = 0;
+    nextSample = nextGap();
+    sampleCount++;
+
+    // allocations from outside of any Lox code: the compiler, and `interpret` setting up
+    keyLength = 0;
+    if(vm.frameCount == 0) {
+        appendKey("(compiler)", 10);
+        charge(profileEntry(&sites, keyBuffer, (int) keyLength), bytes, objects);
+        charge(profileEntry(&stacks, keyBuffer, (int) keyLength), bytes, objects);
+        return;
+    } 
+
+    // the site is the innermost frame, and the stack is every frame, outermost first
+    appendFrame(&vm.frames[vm.frameCount - 1]);
+    charge(profileEntry(&sites, keyBuffer, (int) keyLength), bytes, objects);
+    keyLength = 0;
+    for(int i = 0; i < vm.frameCount; i++) {
+        if(i > 0) appendKey(";", 1);
+        appendFrame(&vm.frames[i]);
+    } 
+    charge(profileEntry(&stacks, keyBuffer, (int) keyLength), bytes, objects);
+} 
+
+// called by `allocateObject` for every object, while the profiler is on
+void sampleAllocation(size_t size) {
+    bytesSinceSample += size;
+    if(bytesSinceSample >= nextSample) takeSample(size);
+} 
+
+static int compareBytes(const void* a, const void* b) {
+    const ProfileEntry* left = *(const ProfileEntry* const*) a;
+    const ProfileEntry* right = *(const ProfileEntry* const*) b;
+    if(left->bytes != right->bytes) return left->bytes < right->bytes ? 1 : -1;
+    return strcmp(left->key, right->key);
+} 
+
+// the entries in use, biggest first
+static ProfileEntry** sortedEntries(ProfileTable* table) {
+    ProfileEntry** sorted = (ProfileEntry**) malloc(sizeof(ProfileEntry*) * (table->count + 1));
+    if(sorted == NULL) outOfMemory();
+    uint32_t count = 0;
+    for(uint32_t i = 0; i < table->capacity; i++)
+        if(table->entries[i].key != NULL) sorted[count++] = &table->entries[i];
+    qsort(sorted, count, sizeof(ProfileEntry*), compareBytes);
+    return sorted;
+} 
+
+// the report by site goes to stderr, and the stacks to `path`, folded the way
+// flamegraph.pl (and most other flame graph tools) read them: "frame;frame;frame bytes"
+bool writeAllocationProfile(const char* path) {
+    size_t total = 0;
+    for(uint32_t i = 0; i < sites.capacity; i++)
+        if(sites.entries[i].key != NULL) total += sites.entries[i].bytes;
+
+    fprintf(stderr, "-- allocation profile: %u samples, about one every %zu bytes\n",
+            sampleCount, sampleRate);
+    fprintf(stderr, "%12s %6s %10s %8s  %s\n", "bytes", "%", "objects", "samples", "site");
+    ProfileEntry** sorted = sortedEntries(&sites);
+    for(uint32_t i = 0; i < sites.count; i++) {
+        ProfileEntry* entry = sorted[i];
+        fprintf(stderr, "%12zu %5.1f%% %10zu %8u  %s\n", entry->bytes,
+                total == 0 ? 0.0 : entry->bytes * 100.0 / total,
+                entry->objects, entry->samples, entry->key);
+    } 
+    free(sorted);
+
+    FILE* file = fopen(path, "w");
+    if(file == NULL) return false;
+    sorted = sortedEntries(&stacks);
+    for(uint32_t i = 0; i < stacks.count; i++)
+        fprintf(file, "%s %zu\n", sorted[i]->key, sorted[i]->bytes);
+    free(sorted);
+    return fclose(file) == 0;
+} 
+
+static void freeProfileTable(ProfileTable* table) {
+    for(uint32_t i = 0; i < table->capacity; i++) free(table->entries[i].key);
+    free(table->entries);
+    table->entries = NULL;
+    table->count = table->capacity = 0;
+} 
+
+void freeAllocationProfile() {
+    freeProfileTable(&sites);
+    freeProfileTable(&stacks);
+    free(keyBuffer);
+    keyBuffer = NULL;
+    keyLength = keyCapacity = 0;
+    sampleCount = 0;
+    vm.sampleAllocations = false;
+} 
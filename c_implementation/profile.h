@@ -0,0 +1,14 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include "common.h"
+
+// about how many bytes of objects get allocated between samples, by default
+#define ALLOC_SAMPLE_RATE (32 * 1024)
+
+void startAllocationProfile(size_t sampleRate);
+void sampleAllocation(size_t size);
+bool writeAllocationProfile(const char* path);
+void freeAllocationProfile();
+
+#endif
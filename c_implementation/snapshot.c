@@ -0,0 +1,509 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "memory.h"
+#include "object.h"
+#include "snapshot.h"
+#include "table.h"
+#include "vm.h"
+
+// allocation sites are only tracked with `vm.trackAllocations` on (`--heap-snapshot`).
+// none of this lives in the garbage-collected heap, so it's all plain `malloc`
+
+// where objects get allocated: a line in a function
+typedef struct {
+    char* function;
+    int line;
+} Site;
+
+// the cache of which site an instruction is
+typedef struct {
+    ObjFunction* function; // NULL for an empty slot
+    uint32_t offset;
+    uint32_t site;
+} SiteKey;
+
+// the site of whatever object was last allocated at (or moved to) an address.
+// entries are never removed: a dead object's address is only ever looked up again
+// once something new is there, and that overwrites it
+typedef struct {
+    uintptr_t address; // 0 for an empty slot
+    uint32_t site;
+} ObjectSite;
+
+static Site* sites = NULL; // `sites[0]` is "don't know"
+static uint32_t siteCount = 0;
+static uint32_t siteCapacity = 0;
+
+static SiteKey* siteKeys = NULL;
+static uint32_t siteKeyCount = 0;
+static uint32_t siteKeyCapacity = 0;
+
+static ObjectSite* objectSites = NULL;
+static uint32_t objectSiteCount = 0;
+static uint32_t objectSiteCapacity = 0;
+
+static void outOfMemory() {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+} 
+
+static void* allocate(size_t size) {
+    void* result = calloc(1, size);
+    if(result == NULL) outOfMemory();
+    return result;
+} 
+
+static uint32_t hashAddress(uintptr_t address) {
+    uint64_t bits = (uint64_t) address;
+    return (uint32_t) ((bits >> 3) ^ (bits >> 32)) * 2654435761u;
+} 
+
+static uint32_t addSite(const char* function, int line) {
+    if(siteCapacity < siteCount + 1) {
+        siteCapacity = GROW_CAPACITY(siteCapacity);
+        sites = (Site*) realloc(sites, sizeof(Site) * siteCapacity);
+        if(sites == NULL) outOfMemory();
+    } 
+    sites[siteCount].function = strdup(function);
+    sites[siteCount].line = line;
+    return siteCount++;
+} 
+
+static SiteKey* findSiteKey(SiteKey* keys, uint32_t capacity, ObjFunction* function, uint32_t offset) {
+    uint32_t index = (hashAddress((uintptr_t) function) ^ offset * 2654435761u) & (capacity - 1);
+    for(;;) {
+        SiteKey* key = &keys[index];
+        if(key->function == NULL || (key->function == function && key->offset == offset))
+            return key;
+        index = (index + 1) & (capacity - 1);
+    } 
+} 
+
+static ObjectSite* findObjectSite(ObjectSite* entries, uint32_t capacity, uintptr_t address) {
+    uint32_t index = hashAddress(address) & (capacity - 1);
+    for(;;) {
+        ObjectSite* entry = &entries[index];
+        if(entry->address == 0 || entry->address == address) return entry;
+        index = (index + 1) & (capacity - 1);
+    } 
+} 
+
+// the instruction the current frame is on
+static uint32_t currentSite() {
+    // allocations from outside of any Lox code (the compiler, mostly)
+    if(vm.frameCount == 0) return 0;
+
+    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    ObjFunction* function = frame->closure->function;
+    uint32_t offset = (uint32_t) (frame->ip - function->chunk.code - 1);
+
+    if(siteKeyCapacity * 3 / 4 < siteKeyCount + 1) {
+        uint32_t capacity = GROW_CAPACITY(siteKeyCapacity);
+        SiteKey* keys = (SiteKey*) allocate(sizeof(SiteKey) * capacity);
+        for(uint32_t i = 0; i < siteKeyCapacity; i++) {
+            if(siteKeys[i].function == NULL) continue;
+            *findSiteKey(keys, capacity, siteKeys[i].function, siteKeys[i].offset) = siteKeys[i];
+        } 
+        free(siteKeys);
+        siteKeys = keys;
+        siteKeyCapacity = capacity;
+    } 
+
+    SiteKey* key = findSiteKey(siteKeys, siteKeyCapacity, function, offset);
+    if(key->function != NULL) return key->site;
+
+    // the first time anything's been allocated here
+    if(siteCount == 0) addSite("", 0);
+    key->function = function;
+    key->offset = offset;
+    key->site = addSite(function->name == NULL ? "script" : function->name->chars,
+                        getLine(&function->chunk, (int) offset));
+    siteKeyCount++;
+    return key->site;
+} 
+
+static void setObjectSite(uintptr_t address, uint32_t site) {
+    if(objectSiteCapacity * 3 / 4 < objectSiteCount + 1) {
+        uint32_t capacity = GROW_CAPACITY(objectSiteCapacity);
+        ObjectSite* entries = (ObjectSite*) allocate(sizeof(ObjectSite) * capacity);
+        for(uint32_t i = 0; i < objectSiteCapacity; i++) {
+            if(objectSites[i].address == 0) continue;
+            *findObjectSite(entries, capacity, objectSites[i].address) = objectSites[i];
+        } 
+        free(objectSites);
+        objectSites = entries;
+        objectSiteCapacity = capacity;
+    } 
+
+    ObjectSite* entry = findObjectSite(objectSites, objectSiteCapacity, address);
+    if(entry->address == 0) objectSiteCount++;
+    entry->address = address;
+    entry->site = site;
+} 
+
+static uint32_t objectSite(Obj* object) {
+    if(objectSiteCount == 0) return 0;
+    ObjectSite* entry = findObjectSite(objectSites, objectSiteCapacity, (uintptr_t) object);
+    return entry->address == 0 ? 0 : entry->site;
+} 
+
+void trackAllocation(Obj* object) {
+    setObjectSite((uintptr_t) object, currentSite());
+} 
+
+// promotion and compaction keep the site
+void trackMove(Obj* from, Obj* to) {
+    setObjectSite((uintptr_t) to, objectSite(from));
+} 
+
+// a function is being freed, and something else might end up at its address
+void forgetSiteCache() {
+    if(siteKeyCount == 0) return;
+    memset(siteKeys, 0, sizeof(SiteKey) * siteKeyCapacity);
+    siteKeyCount = 0;
+} 
+
+void freeAllocationSites() {
+    for(uint32_t i = 0; i < siteCount; i++) free(sites[i].function);
+    free(sites);
+    free(siteKeys);
+    free(objectSites);
+    sites = NULL;
+    siteKeys = NULL;
+    objectSites = NULL;
+    siteCount = siteCapacity = 0;
+    siteKeyCount = siteKeyCapacity = 0;
+    objectSiteCount = objectSiteCapacity = 0;
+} 
+
+// in `ObjType` order
+static const char* typeNames[OBJ_TYPE_COUNT] = {
+    "upvalue", "string", "native", "function", "closure",
+    "class", "instance", "bound method", "weak ref", "weak table",
+};
+
+// one object of the snapshot, before it gets written out
+typedef struct {
+    Obj* object;
+    uint8_t type;
+    uint32_t size;
+    uint32_t name;
+    uint32_t siteFunction;
+    uint32_t siteLine;
+    uint32_t retainer;
+    uint32_t root;
+    uint32_t firstReference;
+    uint32_t referenceCount;
+} Record;
+
+typedef struct {
+    Record* records; // the object numbered `id` is `records[id - 1]`
+    uint32_t count;
+    uint32_t capacity;
+    // object numbers, by address
+    ObjectSite* ids;
+    uint32_t idCapacity;
+    // everyone's references, one after another
+    uint32_t* references;
+    uint32_t referenceCount;
+    uint32_t referenceCapacity;
+    // the string table, and where each string is in it
+    char** strings;
+    uint32_t stringCount;
+    uint32_t stringCapacity;
+    uint32_t* stringSlots; // 0 for an empty slot, otherwise the string's index + 1
+    uint32_t stringSlotCapacity;
+} Snapshot;
+
+static uint32_t findStringSlot(Snapshot* snapshot, uint32_t* slots, uint32_t capacity,
+                               const char* chars, int length) {
+    uint32_t index = hashString(chars, length) & (capacity - 1);
+    for(;;) {
+        uint32_t slot = slots[index];
+        if(slot == 0) return index;
+        const char* other = snapshot->strings[slot - 1];
+        if((int) strlen(other) == length && memcmp(other, chars, length) == 0) return index;
+        index = (index + 1) & (capacity - 1);
+    } 
+} 
+
+static uint32_t snapshotString(Snapshot* snapshot, const char* chars) {
+    int length = (int) strlen(chars);
+    if(snapshot->stringSlotCapacity * 3 / 4 < snapshot->stringCount + 1) {
+        uint32_t capacity = GROW_CAPACITY(snapshot->stringSlotCapacity);
+        uint32_t* slots = (uint32_t*) allocate(sizeof(uint32_t) * capacity);
+        for(uint32_t i = 0; i < snapshot->stringCount; i++) {
+            const char* string = snapshot->strings[i];
+            slots[findStringSlot(snapshot, slots, capacity, string, (int) strlen(string))] = i + 1;
+        } 
+        free(snapshot->stringSlots);
+        snapshot->stringSlots = slots;
+        snapshot->stringSlotCapacity = capacity;
+    } 
+
+    uint32_t index = findStringSlot(snapshot, snapshot->stringSlots,
+                                    snapshot->stringSlotCapacity, chars, length);
+    if(snapshot->stringSlots[index] != 0) return snapshot->stringSlots[index] - 1;
+
+    if(snapshot->stringCapacity < snapshot->stringCount + 1) {
+        snapshot->stringCapacity = GROW_CAPACITY(snapshot->stringCapacity);
+        snapshot->strings = (char**) realloc(snapshot->strings, sizeof(char*) * snapshot->stringCapacity);
+        if(snapshot->strings == NULL) outOfMemory();
+    } 
+    snapshot->strings[snapshot->stringCount] = strdup(chars);
+    snapshot->stringSlots[index] = ++snapshot->stringCount;
+    return snapshot->stringCount - 1;
+} 
+
+// numbers an object the first time it's seen, and queues it up
+static uint32_t visit(Snapshot* snapshot, Obj* object, uint32_t retainer, uint32_t root) {
+    if(snapshot->idCapacity * 3 / 4 < snapshot->count + 1) {
+        uint32_t capacity = GROW_CAPACITY(snapshot->idCapacity);
+        ObjectSite* ids = (ObjectSite*) allocate(sizeof(ObjectSite) * capacity);
+        for(uint32_t i = 0; i < snapshot->idCapacity; i++) {
+            if(snapshot->ids[i].address == 0) continue;
+            *findObjectSite(ids, capacity, snapshot->ids[i].address) = snapshot->ids[i];
+        } 
+        free(snapshot->ids);
+        snapshot->ids = ids;
+        snapshot->idCapacity = capacity;
+    } 
+
+    ObjectSite* entry = findObjectSite(snapshot->ids, snapshot->idCapacity, (uintptr_t) object);
+    if(entry->address != 0) return entry->site;
+
+    if(snapshot->capacity < snapshot->count + 1) {
+        snapshot->capacity = GROW_CAPACITY(snapshot->capacity);
+        snapshot->records = (Record*) realloc(snapshot->records, sizeof(Record) * snapshot->capacity);
+        if(snapshot->records == NULL) outOfMemory();
+    } 
+    Record* record = &snapshot->records[snapshot->count++];
+    record->object = object;
+    record->retainer = retainer;
+    record->root = root;
+    entry->address = (uintptr_t) object;
+    entry->site = snapshot->count;
+    return snapshot->count;
+} 
+
+static void addReference(Snapshot* snapshot, uint32_t from, Obj* object) {
+    if(object == NULL) return;
+    uint32_t id = visit(snapshot, object, from, 0);
+    if(snapshot->referenceCapacity < snapshot->referenceCount + 1) {
+        snapshot->referenceCapacity = GROW_CAPACITY(snapshot->referenceCapacity);
+        snapshot->references = (uint32_t*) realloc(snapshot->references,
+                sizeof(uint32_t) * snapshot->referenceCapacity);
+        if(snapshot->references == NULL) outOfMemory();
+    } 
+    snapshot->references[snapshot->referenceCount++] = id;
+    snapshot->records[from - 1].referenceCount++;
+} 
+
+static void addValue(Snapshot* snapshot, uint32_t from, Value value) {
+    if(IS_OBJ(value)) addReference(snapshot, from, AS_OBJ(value));
+} 
+
+static void addTable(Snapshot* snapshot, uint32_t from, Table* table) {
+    for(int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if(entry->key == NULL) continue;
+        addReference(snapshot, from, (Obj*) entry->key);
+        addValue(snapshot, from, entry->value);
+    } 
+} 
+
+static size_t tableSize(Table* table) {
+    return (size_t) table->capacity * (sizeof(Entry) + sizeof(uint8_t));
+} 
+
+#define OBJECT_SIZE(type) (((sizeof(type)) + 7) & ~(size_t) 7)
+
+// `blackenObject`, but writing down what it finds: the references,
+// how much memory the object has (buffers included) and what it's called
+static void describeObject(Snapshot* snapshot, uint32_t id) {
+    Record* record = &snapshot->records[id - 1];
+    Obj* object = record->object;
+    record->type = object->type;
+    record->name = 0;
+    record->firstReference = snapshot->referenceCount;
+    record->referenceCount = 0;
+    size_t size = 0;
+    const char* name = NULL;
+
+    switch(object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*) object;
+            size = OBJECT_SIZE(ObjBoundMethod);
+            if(bound->method->function->name != NULL) name = bound->method->function->name->chars;
+            addValue(snapshot, id, bound->receiver);
+            addReference(snapshot, id, (Obj*) bound->method);
+            break;
+        } 
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*) object;
+            size = OBJECT_SIZE(ObjInstance) + tableSize(&instance->fields);
+            name = instance->klass->name->chars;
+            addReference(snapshot, id, (Obj*) instance->klass);
+            addTable(snapshot, id, &instance->fields);
+            break;
+        } 
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*) object;
+            size = OBJECT_SIZE(ObjClass) + tableSize(&klass->methods);
+            name = klass->name->chars;
+            addReference(snapshot, id, (Obj*) klass->name);
+            addTable(snapshot, id, &klass->methods);
+            break;
+        } 
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*) object;
+            size = OBJECT_SIZE(ObjClosure) + sizeof(ObjUpvalue*) * closure->upvalueCount;
+            if(closure->function->name != NULL) name = closure->function->name->chars;
+            addReference(snapshot, id, (Obj*) closure->function);
+            for(int i = 0; i < closure->upvalueCount; i++)
+                addReference(snapshot, id, (Obj*) closure->upvalues[i]);
+            break;
+        } 
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*) object;
+            Chunk* chunk = &function->chunk;
+            size = OBJECT_SIZE(ObjFunction) + chunk->capacity + sizeof(int) * chunk->lcapacity
+                   + sizeof(Value) * chunk->constants.capacity;
+            name = function->name == NULL ? "script" : function->name->chars;
+            addReference(snapshot, id, (Obj*) function->name);
+            addReference(snapshot, id, (Obj*) function->closure);
+            for(int i = 0; i < chunk->constants.count; i++)
+                addValue(snapshot, id, chunk->constants.values[i]);
+            break;
+        } 
+        case OBJ_UPVALUE: {
+            ObjUpvalue* upvalue = (ObjUpvalue*) object;
+            size = OBJECT_SIZE(ObjUpvalue);
+            addValue(snapshot, id, upvalue->closed);
+            break;
+        } 
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*) object;
+            size = OBJECT_SIZE(ObjString) + (string->chars != NULL ? string->length + 1 : 0);
+            addReference(snapshot, id, (Obj*) string->left);
+            addReference(snapshot, id, (Obj*) string->right);
+            break;
+        } 
+        case OBJ_NATIVE:
+            size = OBJECT_SIZE(ObjNative);
+            break;
+        // weak references are still references, as far as anyone looking at the heap cares
+        case OBJ_WEAK_REF:
+            size = OBJECT_SIZE(ObjWeakRef);
+            addValue(snapshot, id, ((ObjWeakRef*) object)->target);
+            break;
+        case OBJ_WEAK_TABLE: {
+            ObjWeakTable* table = (ObjWeakTable*) object;
+            size = OBJECT_SIZE(ObjWeakTable) + sizeof(WeakEntry) * table->capacity;
+            for(int i = 0; i < table->capacity; i++) {
+                if(IS_NIL(table->entries[i].key)) continue;
+                addValue(snapshot, id, table->entries[i].key);
+                addValue(snapshot, id, table->entries[i].value);
+            } 
+            break;
+        } 
+    } 
+
+    // `addReference` might have moved the records
+    record = &snapshot->records[id - 1];
+    record->size = (uint32_t) size;
+    if(name != NULL) record->name = snapshotString(snapshot, name);
+    uint32_t site = objectSite(object);
+    record->siteFunction = site == 0 ? 0 : snapshotString(snapshot, sites[site].function);
+    record->siteLine = site == 0 ? 0 : (uint32_t) sites[site].line;
+} 
+
+// the same roots as `markRoots`
+static void visitRoots(Snapshot* snapshot) {
+    uint32_t stack = snapshotString(snapshot, "stack");
+    for(Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        if(IS_OBJ(*slot)) visit(snapshot, AS_OBJ(*slot), 0, stack);
+    } 
+
+    // globals go by their names
+    char label[256];
+    for(int i = 0; i < vm.globalNames.capacity; i++) {
+        Entry* entry = &vm.globalNames.entries[i];
+        if(entry->key == NULL) continue;
+        Value value = vm.globalValues.values[(int) AS_NUMBER(entry->value)];
+        if(!IS_OBJ(value)) continue;
+        snprintf(label, sizeof(label), "global %s", entry->key->chars);
+        visit(snapshot, AS_OBJ(value), 0, snapshotString(snapshot, label));
+    } 
+
+    uint32_t frame = snapshotString(snapshot, "call frame");
+    for(int i = 0; i < vm.frameCount; i++)
+        visit(snapshot, (Obj*) vm.frames[i].closure, 0, frame);
+
+    uint32_t open = snapshotString(snapshot, "open upvalue");
+    for(int slot = 0; slot < vm.openUpvalueEnd; slot++)
+        if(vm.openUpvalues[slot] != NULL) visit(snapshot, (Obj*) vm.openUpvalues[slot], 0, open);
+} 
+
+static void writeInt(FILE* file, uint32_t value) {
+    fwrite(&value, sizeof(value), 1, file);
+} 
+
+// walks everything reachable from the roots, breadth first, and writes it to `path`
+// (see snapshot.h for the format). only call at a safepoint, or from a native:
+// this doesn't allocate anything in the heap, but it does expect the heap to hold still
+bool writeHeapSnapshot(const char* path) {
+    FILE* file = fopen(path, "wb");
+    if(file == NULL) return false;
+
+    Snapshot snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+    snapshotString(&snapshot, ""); // "none"
+    lockHeap();
+    visitRoots(&snapshot);
+    for(uint32_t id = 1; id <= snapshot.count; id++)
+        describeObject(&snapshot, id);
+    unlockHeap();
+    for(int type = 0; type < OBJ_TYPE_COUNT; type++)
+        snapshotString(&snapshot, typeNames[type]);
+
+    fwrite(SNAPSHOT_MAGIC, 1, strlen(SNAPSHOT_MAGIC), file);
+    writeInt(file, SNAPSHOT_VERSION);
+    writeInt(file, snapshot.stringCount);
+    for(uint32_t i = 0; i < snapshot.stringCount; i++) {
+        uint32_t length = (uint32_t) strlen(snapshot.strings[i]);
+        writeInt(file, length);
+        fwrite(snapshot.strings[i], 1, length, file);
+    } 
+    writeInt(file, OBJ_TYPE_COUNT);
+    for(int type = 0; type < OBJ_TYPE_COUNT; type++)
+        writeInt(file, snapshotString(&snapshot, typeNames[type]));
+
+    writeInt(file, snapshot.count);
+    for(uint32_t i = 0; i < snapshot.count; i++) {
+        Record* record = &snapshot.records[i];
+        fwrite(&record->type, sizeof(record->type), 1, file);
+        writeInt(file, record->size);
+        writeInt(file, record->name);
+        writeInt(file, record->siteFunction);
+        writeInt(file, record->siteLine);
+        writeInt(file, record->retainer);
+        writeInt(file, record->root);
+        writeInt(file, record->referenceCount);
+        fwrite(&snapshot.references[record->firstReference], sizeof(uint32_t),
+               record->referenceCount, file);
+    } 
+    bool written = !ferror(file);
+    fclose(file);
+
+    for(uint32_t i = 0; i < snapshot.stringCount; i++) free(snapshot.strings[i]);
+    free(snapshot.strings);
+    free(snapshot.stringSlots);
+    free(snapshot.records);
+    free(snapshot.ids);
+    free(snapshot.references);
+    return written;
+} 
@@ -0,0 +1,30 @@
+#ifndef clox_snapshot_h
+#define clox_snapshot_h
+
+#include "common.h"
+#include "object.h"
+
+// a heap snapshot file, all in the machine's byte order:
+//   "CLOXSNAP", then a uint32 version
+//   uint32 string count, then each string as a uint32 length and its bytes.
+//     string 0 is "", and stands for "none" below
+//   uint32 type count, then the string for each type's name
+//   uint32 object count, then each object:
+//     uint8 type, uint32 size (with whatever buffers it owns),
+//     uint32 name (string: the class of an instance, or a class's or function's name),
+//     uint32 site function (string) and uint32 site line: where it was allocated,
+//     uint32 retainer: the object it was first reached from (0 for a root),
+//     uint32 root (string: what kind of root it is, if it is one),
+//     uint32 reference count, then the objects it references
+// objects are numbered from 1 in the order they appear, breadth first from the roots,
+// so following retainers leads back to a root along one of the shortest paths
+#define SNAPSHOT_MAGIC "CLOXSNAP"
+#define SNAPSHOT_VERSION 1
+
+void trackAllocation(Obj* object);
+void trackMove(Obj* from, Obj* to);
+void forgetSiteCache();
+void freeAllocationSites();
+bool writeHeapSnapshot(const char* path);
+
+#endif
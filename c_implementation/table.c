@@ -5,119 +5,315 @@
 #include "object.h"
 #include "table.h"
 #include "value.h"
+#include "vm.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // load capacity
 // should be tuned properly and tested
 #define TABLE_MAX_LOAD 0.75
+// below this a table shrinks (on its next insert)
+#define TABLE_MIN_LOAD 0.2
+// past this, tombstones are cleared by rehashing the table where it is
+#define TABLE_MAX_TOMBSTONES 0.25
+
+// swiss table layout: next to the entries is an array of control bytes,
+// one per entry, saying whether it is empty, a tombstone, or full.
+// full entries keep the low 7 bits of their key's hash in there,
+// so a probe can rule out 16 entries at once without touching them
+#define GROUP_SIZE 16
+#define CTRL_EMPTY ((uint8_t) 0x80)
+#define CTRL_DELETED ((uint8_t) 0xFE)
+#define HASH_FRAGMENT(hash) ((uint8_t) ((hash) >> 25))
+// the low bits pick a home slot, and with it the group to start probing at
+#define HOME_SLOT(hash, capacity) ((hash) & (uint32_t) ((capacity) - 1))
+// most tables are an instance's few fields, so they don't get a whole group.
+// a table smaller than a group is a group by itself: its control bytes are padded
+// out to a full group with empty ones, which never match a key and end every probe
+#define TABLE_MIN_CAPACITY 4
+#define CONTROL_SIZE(capacity) ((capacity) < GROUP_SIZE ? GROUP_SIZE : (capacity))
+
+static inline uint32_t groupMask(int capacity) {
+	return capacity < GROUP_SIZE ? 0 : (uint32_t) capacity / GROUP_SIZE - 1;
+} 
 
 void initTable(Table* table) {
 	table->count = 0;
+	table->tombstones = 0;
 	table->capacity = 0;
 	table->entries = NULL;
+	table->control = NULL;
 } 
 
 void freeTable(Table* table) {
 	FREE_ARRAY(Entry, table->entries, table->capacity);
+	if(table->control != NULL)
+		FREE_ARRAY(uint8_t, table->control, CONTROL_SIZE(table->capacity));
 	initTable(table);
 } 
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-	uint32_t index = key->hash & (capacity - 1);
-	// this is the earliest earliest_tombstone
-	Entry* earliest_tombstone = NULL;
-
-	// searches for an entry
-	for(;;) {
-		Entry* entry = &entries[index];
-		if(entry->key == NULL) {
-			// this is a truly empty bucket
-			// if we have passed a tombstone (i.e. it is *not* null)
-			// then we return that, for reuse e.g. for setting
-			// otherwise we return the entry
-			if(IS_NIL(entry->value)) {// empty entry
-				return earliest_tombstone != NULL ? earliest_tombstone : entry;
-			}
-			// this is not a truly empty entry, i.e. a tombstone
-			// we set our earliest 
-			else {
-				if (earliest_tombstone == NULL) earliest_tombstone = entry;
-			}
-		} else if(entry->key == key) {
-			return entry;
-		}
-		index = (index + 1) & (capacity - 1);
+// bit i of the result is set if control byte i of the group equals `byte`
+static inline uint32_t matchByte(const uint8_t* group, uint8_t byte) {
+#ifdef __SSE2__
+	__m128i control = _mm_loadu_si128((const __m128i*) group);
+	__m128i matches = _mm_cmpeq_epi8(control, _mm_set1_epi8((char) byte));
+	return (uint32_t) _mm_movemask_epi8(matches);
+#else
+	uint32_t mask = 0;
+	for(int i = 0; i < GROUP_SIZE; i++)
+		if(group[i] == byte) mask |= 1u << i;
+	return mask;
+#endif
+} 
+
+// empty and deleted are the only control bytes with the high bit set
+static inline uint32_t matchFree(const uint8_t* group) {
+#ifdef __SSE2__
+	__m128i control = _mm_loadu_si128((const __m128i*) group);
+	return (uint32_t) _mm_movemask_epi8(control);
+#else
+	uint32_t mask = 0;
+	for(int i = 0; i < GROUP_SIZE; i++)
+		if(group[i] & 0x80) mask |= 1u << i;
+	return mask;
+#endif
+} 
+
+// index of the lowest set bit, i.e. the first matching slot in a group
+#define FIRST_MATCH(mask) __builtin_ctz(mask)
+
+// probes whole groups in a triangular sequence (+1, +2, +3, ...)
+// which visits every group once the group count is a power of 2.
+// a group with an empty slot ends the search: the key was never placed past it.
+// most tables are a handful of fields, so the home slot gets checked first
+static int findSlot(Entry* entries, uint8_t* control, int capacity, ObjString* key) {
+	uint32_t home = HOME_SLOT(key->hash, capacity);
+	uint8_t fragment = HASH_FRAGMENT(key->hash);
+	if(control[home] == fragment && entries[home].key == key) return home;
+
+	uint32_t groups = groupMask(capacity);
+	uint32_t group = home / GROUP_SIZE;
+
+	for(uint32_t stride = 1; ; stride++) {
+		uint8_t* groupControl = &control[group * GROUP_SIZE];
+		for(uint32_t mask = matchByte(groupControl, fragment); mask != 0; mask &= mask - 1) {
+			int index = group * GROUP_SIZE + FIRST_MATCH(mask);
+			if(entries[index].key == key) return index;
+		} 
+		if(matchByte(groupControl, CTRL_EMPTY) != 0) return -1;
+		group = (group + stride) & groups;
+	} 
+	// the load factor guarantees some group has an empty slot
+} 
+
+// where a new key goes: its home slot if that's free, otherwise
+// the first empty slot *or tombstone* on its probe sequence
+static int findFreeSlot(uint8_t* control, int capacity, uint32_t hash) {
+	uint32_t home = HOME_SLOT(hash, capacity);
+	if(control[home] & 0x80) return home;
+
+	uint32_t groups = groupMask(capacity);
+	uint32_t group = home / GROUP_SIZE;
+	// the padding of a small table is free too, but it has no entries behind it
+	uint32_t slots = capacity < GROUP_SIZE ? (1u << capacity) - 1 : 0xFFFFFFFFu;
+
+	for(uint32_t stride = 1; ; stride++) {
+		uint32_t mask = matchFree(&control[group * GROUP_SIZE]) & slots;
+		if(mask != 0) return group * GROUP_SIZE + FIRST_MATCH(mask);
+		group = (group + stride) & groups;
+	} 
+} 
+
+// smallest capacity that holds `count` entries at half the max load,
+// so a resize always leaves room to grow before the next one.
+// tables smaller than a group just double instead: a probe scans all of one at once,
+// and an instance with a few more fields shouldn't jump straight to a big table
+static int capacityFor(int count) {
+	int capacity = TABLE_MIN_CAPACITY;
+	while(capacity < GROUP_SIZE && count > capacity * TABLE_MAX_LOAD) capacity *= 2;
+	if(capacity < GROUP_SIZE) return capacity;
+	while(count > capacity * TABLE_MAX_LOAD / 2) capacity *= 2;
+	return capacity;
+} 
+
+// turns every tombstone back into an empty slot without a new array.
+// allocates nothing, so the GC can do this right after emptying out the intern table
+static void rehashInPlace(Table* table) {
+	Entry* entries = table->entries;
+	uint8_t* control = table->control;
+
+	// full slots are marked as deleted, meaning "not placed yet",
+	// and everything else (tombstones included) becomes empty
+	for(int i = 0; i < table->capacity; i++)
+		control[i] = (control[i] & 0x80) ? CTRL_EMPTY : CTRL_DELETED;
+
+	for(int i = 0; i < table->capacity; i++) {
+		if(control[i] != CTRL_DELETED) continue;
+		ObjString* key = entries[i].key;
+		int target = findFreeSlot(control, table->capacity, key->hash);
+
+		// probing reaches this group at the same point either way
+		if(target / GROUP_SIZE == i / GROUP_SIZE) {
+			control[i] = HASH_FRAGMENT(key->hash);
+		} else if(control[target] == CTRL_EMPTY) {
+			entries[target] = entries[i];
+			control[target] = HASH_FRAGMENT(key->hash);
+			entries[i].key = NULL;
+			entries[i].value = NIL_VAL;
+			control[i] = CTRL_EMPTY;
+		} else {
+			// the target has an entry that isn't placed yet: swap, and place that one next
+			Entry displaced = entries[target];
+			entries[target] = entries[i];
+			control[target] = HASH_FRAGMENT(key->hash);
+			entries[i] = displaced;
+			i--;
+		} 
 	} 
-	// no need to check if we *can't* find a bucket because this is impossible
+	table->tombstones = 0;
 } 
 
-static void adjustCapacity(Table* table, int capacity) {
-	Entry* entries = ALLOCATE(Entry, capacity);
+// a script can make a table as big as it likes, so growing can go through `tryReallocate`.
+// false if that was turned down, and then the table is left as it was
+static bool adjustCapacity(Table* table, int capacity, bool canFail) {
+	Entry* entries;
+	uint8_t* control;
+	if(canFail && capacity > table->capacity) {
+		entries = TRY_ALLOCATE(Entry, capacity);
+		if(entries == NULL) return false;
+		control = TRY_ALLOCATE(uint8_t, CONTROL_SIZE(capacity));
+		if(control == NULL) {
+			FREE_ARRAY(Entry, entries, capacity);
+			return false;
+		} 
+	} else {
+		entries = ALLOCATE(Entry, capacity);
+		control = ALLOCATE(uint8_t, CONTROL_SIZE(capacity));
+	} 
 	// zero out the array
 	for(int i = 0; i < capacity; i++) {
 		entries[i].key = NULL;
 		entries[i].value = NIL_VAL;
 	} 
+	memset(control, CTRL_EMPTY, CONTROL_SIZE(capacity));
 
 	// copy over the elements
 	table->count = 0;
+	table->tombstones = 0;
 	for(int i = 0; i < table->capacity; i++) {
 		Entry* entry = &table->entries[i];
 		if(entry->key == NULL) continue; // conveniently ignores tombstones
-		Entry* dest = findEntry(entries, capacity, entry->key);
-		dest->key = entry->key;
-		dest->value = entry->value;
+		int index = findFreeSlot(control, capacity, entry->key->hash);
+		control[index] = HASH_FRAGMENT(entry->key->hash);
+		entries[index] = *entry;
 		table->count++;
 	} 
 
 	// free the old array
 	FREE_ARRAY(Entry, table->entries, table->capacity);
+	if(table->control != NULL)
+		FREE_ARRAY(uint8_t, table->control, CONTROL_SIZE(table->capacity));
 
 	// set the new array
 	table->entries = entries;
+	table->control = control;
 	table->capacity = capacity;
+	return true;
 } 
 
 bool tableSet(Table* table, ObjString* key, Value value) {
+	// keys are compared by pointer, so they have to be the interned copy.
+	// that copy might only be held (weakly) by `vm.strings`, so keep it alive while growing
+	if(!key->isInterned) {
+		ObjString* interned = internString(key);
+		push(OBJ_VAL(interned));
+		bool isNewKey = tableSet(table, interned, value);
+		pop();
+		return isNewKey;
+	} 
+
+	// the background marker might be reading this table
+	lockHeap();
+
+	// did we overwrite something?
+	if(table->count > 0) {
+		int index = findSlot(table->entries, table->control, table->capacity, key);
+		if(index >= 0) {
+			snapshotBarrier(table->entries[index].value);
+			table->entries[index].value = value;
+			unlockHeap();
+			return false;
+		} 
+	} 
+
 	// regrowing requires refinding places for everything
-	if(table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-		int capacity = GROW_CAPACITY(table->capacity);
-		adjustCapacity(table, capacity);
+	if(table->count + table->tombstones + 1 > table->capacity * TABLE_MAX_LOAD) {
+		// if it's mostly tombstones, clearing those out makes enough room
+		if(table->tombstones > table->capacity * TABLE_MAX_TOMBSTONES) {
+			rehashInPlace(table);
+		} else if(!adjustCapacity(table, capacityFor(table->count + 1), true)) {
+			// over the heap limit: the next safepoint gets a last chance to collect,
+			// and until then the table fills up past its load factor.
+			// it needs an empty slot left over to stop probes, though
+			if(table->count + table->tombstones + 2 > table->capacity)
+				adjustCapacity(table, capacityFor(table->count + 1), false);
+		} 
+	} else if(table->capacity > TABLE_MIN_CAPACITY && 
+			  table->count + 1 < table->capacity * TABLE_MIN_LOAD) {
+		// most of what was here got deleted; stop probing across empty groups
+		adjustCapacity(table, capacityFor(table->count + 1), false);
 	} 
-	Entry* entry = findEntry(table->entries, table->capacity, key);
-	// is this a new entry, or did we overwrite something?
-	bool isNewKey = entry->key == NULL;
-	if(isNewKey && IS_NIL(entry->value)) table->count++;
-	entry->key = key;
-	entry->value = value;
-	return isNewKey;
+
+	// this is a new entry, possibly reusing a tombstone
+	int index = findFreeSlot(table->control, table->capacity, key->hash);
+	if(table->control[index] == CTRL_DELETED) table->tombstones--;
+	table->count++;
+	table->control[index] = HASH_FRAGMENT(key->hash);
+	table->entries[index].key = key;
+	table->entries[index].value = value;
+	unlockHeap();
+	return true;
 } 
 
 bool tableGet(Table* table, ObjString* key, Value* value) {
+	if(!key->isInterned) key = internString(key);
 	if(table->count == 0) return false; // this is an optimization
-	Entry* entry = findEntry(table->entries, table->capacity, key);
-	if(entry->key == NULL) return false; 
+	int index = findSlot(table->entries, table->control, table->capacity, key);
+	if(index < 0) return false; 
 	
 	// value is just a return thing
-	*value = entry->value;
+	*value = table->entries[index].value;
 	return true;
 } 
 
 bool tableKeyExists(Table* table, ObjString* key) {
+    if(!key->isInterned) key = internString(key);
     if(table->count == 0) return false;
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    return entry->key != NULL;
+    return findSlot(table->entries, table->control, table->capacity, key) >= 0;
 } 
 
 bool tableDelete(Table* table, ObjString* key) {
+	if(!key->isInterned) key = internString(key);
 	if(table->count == 0) return false;
 
 	// get entry
-	Entry* entry = findEntry(table->entries, table->capacity, key);
-	if(entry->key == NULL) return false;
+	int index = findSlot(table->entries, table->control, table->capacity, key);
+	if(index < 0) return false;
 
-	// place tombstone: null key, but true value?
-	entry->key = NULL;
-	entry->value = BOOL_VAL(true);
+	// a group that still has an empty slot was never full, so no probe
+	// has ever gone past it: the slot can go straight back to being empty.
+	// otherwise place a tombstone: probes have to keep going past this slot
+	if(matchByte(&table->control[index / GROUP_SIZE * GROUP_SIZE], CTRL_EMPTY) != 0) {
+		table->control[index] = CTRL_EMPTY;
+	} else {
+		table->control[index] = CTRL_DELETED;
+		table->tombstones++;
+	} 
+	table->entries[index].key = NULL;
+	table->entries[index].value = NIL_VAL;
+	table->count--;
 	return true;
 } 
 
@@ -139,20 +335,25 @@ void tableAddAll(Table* from, Table* to) {
 	} 
 } 
 
-// mostly redundant with findEntry, except we use a raw char and memcmp
+// mostly redundant with findSlot, except we use a raw char and memcmp
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
 	if(table->count == 0) return NULL;
-	uint32_t index = hash & (table->capacity - 1);
-	for(;;) {
-		Entry* entry = &table->entries[index];
-		if(entry->key == NULL) {
-			if(IS_NIL(entry->value)) return NULL;
-		} else if(entry->key->length == length && 
-				  entry->key->hash == hash &&
-				  memcmp(entry->key->chars, chars, length) == 0) {
-			return entry->key;
+	uint32_t groups = groupMask(table->capacity);
+	uint32_t group = HOME_SLOT(hash, table->capacity) / GROUP_SIZE;
+	uint8_t fragment = HASH_FRAGMENT(hash);
+
+	for(uint32_t stride = 1; ; stride++) {
+		uint8_t* groupControl = &table->control[group * GROUP_SIZE];
+		for(uint32_t mask = matchByte(groupControl, fragment); mask != 0; mask &= mask - 1) {
+			ObjString* key = table->entries[group * GROUP_SIZE + FIRST_MATCH(mask)].key;
+			if(key->length == length && 
+			   key->hash == hash &&
+			   memcmp(key->chars, chars, length) == 0) {
+				return key;
+			} 
 		} 
-		index = (index + 1) & (table->capacity - 1);
+		if(matchByte(groupControl, CTRL_EMPTY) != 0) return NULL;
+		group = (group + stride) & groups;
 	} 
 } 
 
@@ -160,9 +361,29 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
 void tableRemoveWhite(Table* table) {
     for(int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        if(entry->key != NULL && !entry->key->obj.isMarked)
+        if(entry->key != NULL && !isMarked((Obj*) entry->key))
             tableDelete(table, entry->key);
     } 
+    // this runs after every GC, so clear the tombstones out here
+    // rather than letting probes get longer and longer
+    if(table->tombstones > table->capacity * TABLE_MAX_TOMBSTONES)
+        rehashInPlace(table);
+} 
+
+// the minor collection version of `tableRemoveWhite`:
+// young keys that were copied out get their new address, the rest are dead.
+// the hash moved along with the string, so nothing needs to be reinserted
+void tableSweepYoung(Table* table) {
+    for(int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if(entry->key == NULL || entry->key->obj.isOld) continue;
+        if(entry->key->obj.isForwarded)
+            entry->key = (ObjString*) OBJ_LINK(entry->key);
+        else
+            tableDelete(table, entry->key);
+    } 
+    if(table->tombstones > table->capacity * TABLE_MAX_TOMBSTONES)
+        rehashInPlace(table);
 } 
 
 void markTable(Table* table) {
@@ -172,3 +393,12 @@ void markTable(Table* table) {
         markValue(entry->value);
     } 
 } 
+
+void evacuateTable(Table* table) {
+    for(int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if(entry->key == NULL) continue;
+        entry->key = (ObjString*) evacuateObject((Obj*) entry->key);
+        evacuateValue(&entry->value);
+    } 
+} 
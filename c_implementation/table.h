@@ -11,9 +11,12 @@ typedef struct {
 } Entry;
 
 typedef struct {
-	int count;
+	int count; // live entries only
+	int tombstones;
 	int capacity;
 	Entry* entries;
+	// one byte per entry: empty, tombstone, or 7 bits of the key's hash
+	uint8_t* control;
 } Table;
 
 void initTable(Table* table);
@@ -27,5 +30,7 @@ void tableAddAll(Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 void tableRemoveWhite(Table* table);
 void markTable(Table* table);
+void evacuateTable(Table* table);
+void tableSweepYoung(Table* table);
 
 #endif
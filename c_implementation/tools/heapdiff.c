@@ -0,0 +1,301 @@
+// reads heap snapshots (from `--heap-snapshot` or `heapSnapshot()`) and says where the memory went.
+// with one snapshot, groups what's in it; with two, what changed from the first to the second.
+// objects are grouped by type, name, and allocation site, biggest growth first,
+// and each of the top groups gets the path that keeps one of its objects alive.
+// build with `make heapdiff`, then `./heapdiff [before.snap] after.snap [groups]`
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../snapshot.h"
+
+#define DEFAULT_GROUPS 20
+#define MAX_PATH_LENGTH 32
+
+typedef struct {
+    uint8_t type;
+    uint32_t size;
+    uint32_t name;
+    uint32_t siteFunction;
+    uint32_t siteLine;
+    uint32_t retainer;
+    uint32_t root;
+} Record;
+
+typedef struct {
+    uint32_t stringCount;
+    char** strings;
+    uint32_t typeCount;
+    uint32_t* typeNames;
+    uint32_t count;
+    Record* records; // records[0] is unused: ids start at 1
+} Snapshot;
+
+// everything of one type and name allocated at one place
+typedef struct {
+    const char* type;
+    const char* name;
+    const char* function;
+    uint32_t line;
+    long count[2];
+    long bytes[2];
+    uint32_t example; // an object in the newer snapshot, or 0
+} Group;
+
+typedef struct {
+    int count;
+    int capacity;
+    Group* groups;
+    int* slots; // open addressing into `groups`, -1 for empty
+    int slotCount;
+} Groups;
+
+static uint32_t readInt(FILE* file, const char* path) {
+    uint32_t value;
+    if(fread(&value, sizeof(value), 1, file) != 1) {
+        fprintf(stderr, "%s: cut short.\n", path);
+        exit(74);
+    }
+    return value;
+}
+
+static void readSnapshot(const char* path, Snapshot* snapshot) {
+    FILE* file = fopen(path, "rb");
+    if(file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+
+    char magic[sizeof(SNAPSHOT_MAGIC) - 1];
+    if(fread(magic, 1, sizeof(magic), file) != sizeof(magic)
+       || memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "%s: not a heap snapshot.\n", path);
+        exit(65);
+    }
+    uint32_t version = readInt(file, path);
+    if(version != SNAPSHOT_VERSION) {
+        fprintf(stderr, "%s: snapshot version %u, expected %u.\n", path, version, SNAPSHOT_VERSION);
+        exit(65);
+    }
+
+    snapshot->stringCount = readInt(file, path);
+    snapshot->strings = malloc(sizeof(char*) * snapshot->stringCount);
+    for(uint32_t i = 0; i < snapshot->stringCount; i++) {
+        uint32_t length = readInt(file, path);
+        snapshot->strings[i] = malloc(length + 1);
+        if(fread(snapshot->strings[i], 1, length, file) != length) {
+            fprintf(stderr, "%s: cut short.\n", path);
+            exit(74);
+        }
+        snapshot->strings[i][length] = '\0';
+    }
+
+    snapshot->typeCount = readInt(file, path);
+    snapshot->typeNames = malloc(sizeof(uint32_t) * snapshot->typeCount);
+    for(uint32_t i = 0; i < snapshot->typeCount; i++)
+        snapshot->typeNames[i] = readInt(file, path);
+
+    snapshot->count = readInt(file, path);
+    snapshot->records = malloc(sizeof(Record) * (snapshot->count + 1));
+    for(uint32_t id = 1; id <= snapshot->count; id++) {
+        Record* record = &snapshot->records[id];
+        if(fread(&record->type, sizeof(record->type), 1, file) != 1) {
+            fprintf(stderr, "%s: cut short.\n", path);
+            exit(74);
+        }
+        record->size = readInt(file, path);
+        record->name = readInt(file, path);
+        record->siteFunction = readInt(file, path);
+        record->siteLine = readInt(file, path);
+        record->retainer = readInt(file, path);
+        record->root = readInt(file, path);
+        // the references themselves aren't needed: the retainers are enough for the paths
+        uint32_t references = readInt(file, path);
+        if(fseek(file, (long)references * sizeof(uint32_t), SEEK_CUR) != 0) {
+            fprintf(stderr, "%s: cut short.\n", path);
+            exit(74);
+        }
+    }
+    fclose(file);
+}
+
+static const char* stringAt(Snapshot* snapshot, uint32_t index) {
+    return index < snapshot->stringCount ? snapshot->strings[index] : "?";
+}
+
+static const char* typeOf(Snapshot* snapshot, Record* record) {
+    return record->type < snapshot->typeCount
+        ? stringAt(snapshot, snapshot->typeNames[record->type]) : "?";
+}
+
+// FNV-1a, over the parts of the key
+static uint32_t hashPart(uint32_t hash, const char* chars) {
+    for(; *chars != '\0'; chars++) {
+        hash ^= (uint8_t)*chars;
+        hash *= 16777619;
+    }
+    return hash * 16777619;
+}
+
+static void growSlots(Groups* groups) {
+    free(groups->slots);
+    groups->slotCount = groups->slotCount == 0 ? 64 : groups->slotCount * 2;
+    groups->slots = malloc(sizeof(int) * groups->slotCount);
+    for(int i = 0; i < groups->slotCount; i++) groups->slots[i] = -1;
+    for(int i = 0; i < groups->count; i++) {
+        Group* group = &groups->groups[i];
+        uint32_t hash = hashPart(hashPart(hashPart(2166136261u, group->type), group->name), group->function) ^ group->line;
+        int slot = hash & (groups->slotCount - 1);
+        while(groups->slots[slot] != -1) slot = (slot + 1) & (groups->slotCount - 1);
+        groups->slots[slot] = i;
+    }
+}
+
+static Group* findGroup(Groups* groups, const char* type, const char* name, const char* function, uint32_t line) {
+    if((groups->count + 1) * 4 > groups->slotCount * 3) growSlots(groups);
+    uint32_t hash = hashPart(hashPart(hashPart(2166136261u, type), name), function) ^ line;
+    int slot = hash & (groups->slotCount - 1);
+    while(groups->slots[slot] != -1) {
+        Group* group = &groups->groups[groups->slots[slot]];
+        if(group->line == line && strcmp(group->type, type) == 0
+           && strcmp(group->name, name) == 0 && strcmp(group->function, function) == 0)
+            return group;
+        slot = (slot + 1) & (groups->slotCount - 1);
+    }
+
+    if(groups->count == groups->capacity) {
+        groups->capacity = groups->capacity == 0 ? 64 : groups->capacity * 2;
+        groups->groups = realloc(groups->groups, sizeof(Group) * groups->capacity);
+    }
+    groups->slots[slot] = groups->count;
+    Group* group = &groups->groups[groups->count++];
+    memset(group, 0, sizeof(Group));
+    group->type = type;
+    group->name = name;
+    group->function = function;
+    group->line = line;
+    return group;
+}
+
+// `which` is 0 for the older snapshot and 1 for the newer one
+static void addSnapshot(Groups* groups, Snapshot* snapshot, int which) {
+    for(uint32_t id = 1; id <= snapshot->count; id++) {
+        Record* record = &snapshot->records[id];
+        Group* group = findGroup(groups, typeOf(snapshot, record),
+                                 stringAt(snapshot, record->name),
+                                 stringAt(snapshot, record->siteFunction), record->siteLine);
+        group->count[which]++;
+        group->bytes[which] += record->size;
+        // the last one found is the furthest from the roots, so its path says the most
+        if(which == 1) group->example = id;
+    }
+}
+
+static int compareGroups(const void* a, const void* b) {
+    const Group* left = a;
+    const Group* right = b;
+    long leftGrowth = left->bytes[1] - left->bytes[0];
+    long rightGrowth = right->bytes[1] - right->bytes[0];
+    if(leftGrowth != rightGrowth) return leftGrowth < rightGrowth ? 1 : -1;
+    return left->bytes[1] < right->bytes[1] ? 1 : left->bytes[1] > right->bytes[1] ? -1 : 0;
+}
+
+static void printSite(const char* function, uint32_t line) {
+    if(line == 0) printf("unknown site");
+    else printf("%s:%u", function[0] == '\0' ? "script" : function, line);
+}
+
+static void printRecord(Snapshot* snapshot, Record* record) {
+    const char* name = stringAt(snapshot, record->name);
+    printf("%s%s%s", typeOf(snapshot, record), name[0] == '\0' ? "" : " ", name);
+}
+
+static bool sameKind(Record* a, Record* b) {
+    return a->type == b->type && a->name == b->name;
+}
+
+// follows the retainers back to a root, folding runs of the same kind of object (like a list) into one line
+static void printRetainers(Snapshot* snapshot, uint32_t id) {
+    for(int depth = 0; id != 0 && id <= snapshot->count; depth++) {
+        Record* record = &snapshot->records[id];
+        if(depth == MAX_PATH_LENGTH) {
+            printf("        ...\n");
+            return;
+        }
+        int run = 1;
+        while(record->retainer != 0 && record->retainer <= snapshot->count
+              && sameKind(&snapshot->records[record->retainer], record)) {
+            id = record->retainer;
+            record = &snapshot->records[id];
+            run++;
+        }
+        printf("        %s ", depth == 0 ? "  " : "<-");
+        printRecord(snapshot, record);
+        if(run > 1) printf(" (x%d)", run);
+        if(record->retainer == 0) printf("  [%s]", stringAt(snapshot, record->root));
+        printf("\n");
+        id = record->retainer;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if(argc < 2 || argc > 4) {
+        fprintf(stderr, "Usage: heapdiff [before.snap] after.snap [groups]\n");
+        return 64;
+    }
+
+    // a last argument that's a number is how many groups to show
+    int shown = DEFAULT_GROUPS;
+    char* end;
+    long groupsArg = strtol(argv[argc - 1], &end, 10);
+    if(argc > 2 && *end == '\0' && groupsArg > 0) {
+        shown = (int)groupsArg;
+        argc--;
+    }
+    if(argc > 3) {
+        fprintf(stderr, "Usage: heapdiff [before.snap] after.snap [groups]\n");
+        return 64;
+    }
+
+    Snapshot before = {0};
+    Snapshot after = {0};
+    bool diffing = argc == 3;
+    if(diffing) readSnapshot(argv[1], &before);
+    readSnapshot(argv[argc - 1], &after);
+
+    Groups groups = {0};
+    if(diffing) addSnapshot(&groups, &before, 0);
+    addSnapshot(&groups, &after, 1);
+    qsort(groups.groups, groups.count, sizeof(Group), compareGroups);
+
+    long totalBytes[2] = {0, 0};
+    long totalCount[2] = {0, 0};
+    for(int i = 0; i < groups.count; i++) {
+        for(int which = 0; which < 2; which++) {
+            totalBytes[which] += groups.groups[i].bytes[which];
+            totalCount[which] += groups.groups[i].count[which];
+        }
+    }
+    if(diffing)
+        printf("%ld objects, %ld bytes -> %ld objects, %ld bytes (%+ld)\n\n",
+               totalCount[0], totalBytes[0], totalCount[1], totalBytes[1], totalBytes[1] - totalBytes[0]);
+    else
+        printf("%ld objects, %ld bytes\n\n", totalCount[1], totalBytes[1]);
+
+    if(shown > groups.count) shown = groups.count;
+    for(int i = 0; i < shown; i++) {
+        Group* group = &groups.groups[i];
+        if(diffing)
+            printf("%+10ld bytes %+8ld objects  ", group->bytes[1] - group->bytes[0],
+                   group->count[1] - group->count[0]);
+        else
+            printf("%10ld bytes %8ld objects  ", group->bytes[1], group->count[1]);
+        printf("%s%s%s  from ", group->type, group->name[0] == '\0' ? "" : " ", group->name);
+        printSite(group->function, group->line);
+        printf("\n");
+        if(group->example != 0) printRetainers(&after, group->example);
+    }
+    return 0;
+}
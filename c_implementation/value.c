@@ -65,6 +65,9 @@ bool valuesEqual(Value a, Value b) {
     // this number business is for NaN
     if(IS_NUMBER(a) && IS_NUMBER(b))
         return AS_NUMBER(a) == AS_NUMBER(b);
+    // strings built from ropes aren't interned, so compare those by content
+    if(IS_STRING(a) && IS_STRING(b))
+        return stringsEqual(AS_STRING(a), AS_STRING(b));
     return a == b;
 #else
 	// different types ==> unequal
@@ -73,7 +76,11 @@ bool valuesEqual(Value a, Value b) {
 		case VAL_BOOL:		return AS_BOOL(a) == AS_BOOL(b);
 		case VAL_NIL:		return true;
 		case VAL_NUMBER:	return AS_NUMBER(a) == AS_NUMBER(b);
-		case VAL_OBJ:		return AS_OBJ(a) == AS_OBJ(b);
+		case VAL_OBJ:
+			// strings built from ropes aren't interned, so compare those by content
+			if(IS_STRING(a) && IS_STRING(b))
+				return stringsEqual(AS_STRING(a), AS_STRING(b));
+			return AS_OBJ(a) == AS_OBJ(b);
 		default: 			return false; // never reached
 	} 
 #endif
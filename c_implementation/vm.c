@@ -1,5 +1,7 @@
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
@@ -8,8 +10,11 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "hash.h"
 #include "object.h"
 #include "memory.h"
+#include "weak.h"
+#include "snapshot.h"
 
 // global variable?
 VM vm;
@@ -17,10 +22,11 @@ VM vm;
 /* ----- NATIVE FUNCTIONS ----- */
 static char* arityCheck(int trueArity, int numArguments, const char* name) {
     if(trueArity == numArguments) return NULL;
-    char* errorMsg = ALLOCATE(char, 61 + strlen(name)); 
-    snprintf(errorMsg, 61 + strlen(name), 
-        "Expected %d arguments but got %d in native function '%s'.",
-        trueArity, numArguments, name);
+    // exactly as long as the message: `takeString` frees it by its length
+    const char* format = "Expected %d arguments but got %d in native function '%s'.";
+    int length = snprintf(NULL, 0, format, trueArity, numArguments, name);
+    char* errorMsg = ALLOCATE(char, length + 1); 
+    snprintf(errorMsg, length + 1, format, trueArity, numArguments, name);
     return errorMsg;
 } 
 
@@ -68,11 +74,145 @@ static Value sqrtNative(int argCount, Value* args, bool* wasError) {
     return NUMBER_VAL(sqrt(num));
 } 
 
+// for the natives below, which all check their arguments the same way
+#define CHECK_ARITY(arity, name) \
+    do { \
+        char* arityError = arityCheck(arity, argCount, name); \
+        if(arityError != NULL) { \
+            *wasError = true; \
+            return OBJ_VAL(takeString(arityError, (int) strlen(arityError))); \
+        } \
+    } while(false)
+
+static Value nativeError(const char* message, bool* wasError) {
+    *wasError = true;
+    return OBJ_VAL(copyString(message, (int) strlen(message)));
+} 
+
+// natives that need a string argument's characters join it with this,
+// since it could be a rope too big for the heap. on failure
+// `callValue` sees what `tryReallocate` turned down, and collects and calls again
+static bool flattenArgument(Value arg) {
+    return !IS_STRING(arg) || tryFlattenString(AS_STRING(arg));
+} 
+
+// a reference that doesn't keep `object` alive
+static Value weakRefNative(int argCount, Value* args, bool* wasError) {
+    CHECK_ARITY(1, "weakRef");
+    if(!IS_OBJ(args[0]))
+        return nativeError("'weakRef' expects an object.", wasError);
+    return OBJ_VAL(newWeakRef(args[0]));
+} 
+
+// the object, or nil once it has been collected
+static Value derefNative(int argCount, Value* args, bool* wasError) {
+    CHECK_ARITY(1, "deref");
+    if(!IS_WEAK_REF(args[0]))
+        return nativeError("'deref' expects a weak reference.", wasError);
+    return AS_WEAK_REF(args[0])->target;
+} 
+
+// "k" for weak keys, "v" for weak values, "kv" for both
+static Value weakTableNative(int argCount, Value* args, bool* wasError) {
+    CHECK_ARITY(1, "weakTable");
+    if(!flattenArgument(args[0])) return nativeError("Out of memory.", wasError);
+    const char* mode = IS_STRING(args[0]) ? AS_CSTRING(args[0]) : "";
+    bool weakKeys = strcmp(mode, "k") == 0 || strcmp(mode, "kv") == 0;
+    bool weakValues = strcmp(mode, "v") == 0 || strcmp(mode, "kv") == 0;
+    if(!weakKeys && !weakValues)
+        return nativeError("'weakTable' expects \"k\", \"v\" or \"kv\".", wasError);
+    return OBJ_VAL(newWeakTable(weakKeys, weakValues));
+} 
+
+// the rest take the table and a key first
+static bool checkWeakTable(Value* args, const char* name, Value* error, bool* wasError) {
+    char message[64];
+    if(!IS_WEAK_TABLE(args[0])) {
+        snprintf(message, sizeof(message), "'%s' expects a weak table.", name);
+        *error = nativeError(message, wasError);
+        return false;
+    } 
+    if(IS_NIL(args[1])) {
+        snprintf(message, sizeof(message), "'%s' can't take a nil key.", name);
+        *error = nativeError(message, wasError);
+        return false;
+    } 
+    // string keys get interned, though looking in an empty table doesn't get that far
+    if(AS_WEAK_TABLE(args[0])->count > 0 && !flattenArgument(args[1])) {
+        *error = nativeError("Out of memory.", wasError);
+        return false;
+    } 
+    return true;
+} 
+
+// nil if there's nothing under that key
+static Value weakGetNative(int argCount, Value* args, bool* wasError) {
+    CHECK_ARITY(2, "weakGet");
+    Value result;
+    if(!checkWeakTable(args, "weakGet", &result, wasError)) return result;
+    if(!weakTableGet(AS_WEAK_TABLE(args[0]), args[1], &result)) return NIL_VAL;
+    return result;
+} 
+
+static Value weakHasNative(int argCount, Value* args, bool* wasError) {
+    CHECK_ARITY(2, "weakHas");
+    Value result;
+    if(!checkWeakTable(args, "weakHas", &result, wasError)) return result;
+    return BOOL_VAL(weakTableGet(AS_WEAK_TABLE(args[0]), args[1], &result));
+} 
+
+// returns the value
+static Value weakSetNative(int argCount, Value* args, bool* wasError) {
+    CHECK_ARITY(3, "weakSet");
+    Value error;
+    if(!checkWeakTable(args, "weakSet", &error, wasError)) return error;
+    if(!flattenArgument(args[1])) return nativeError("Out of memory.", wasError);
+    weakTableSet(AS_WEAK_TABLE(args[0]), args[1], args[2]);
+    return args[2];
+} 
+
+// whether there was anything to delete
+static Value weakDeleteNative(int argCount, Value* args, bool* wasError) {
+    CHECK_ARITY(2, "weakDelete");
+    Value error;
+    if(!checkWeakTable(args, "weakDelete", &error, wasError)) return error;
+    return BOOL_VAL(weakTableDelete(AS_WEAK_TABLE(args[0]), args[1]));
+} 
+
+// entries whose keys or values are dead only go away at the end of a major collection
+static Value weakCountNative(int argCount, Value* args, bool* wasError) {
+    CHECK_ARITY(1, "weakCount");
+    if(!IS_WEAK_TABLE(args[0]))
+        return nativeError("'weakCount' expects a weak table.", wasError);
+    return NUMBER_VAL(AS_WEAK_TABLE(args[0])->count);
+} 
+
+// the freezing waits for the next safepoint, right after this call
+static Value freezeNative(int argCount, Value* args, bool* wasError) {
+    (void) args;
+    CHECK_ARITY(0, "freeze");
+    if(vm.scopeOpen)
+        return nativeError("Can't freeze the heap inside a request scope.", wasError);
+    vm.freezeRequested = true;
+    vm.gcRequested = true;
+    return NIL_VAL;
+} 
+
+static Value heapSnapshotNative(int argCount, Value* args, bool* wasError) {
+    CHECK_ARITY(1, "heapSnapshot");
+    if(!IS_STRING(args[0]))
+        return nativeError("'heapSnapshot' expects a file name.", wasError);
+    if(!flattenArgument(args[0])) return nativeError("Out of memory.", wasError);
+    return BOOL_VAL(writeHeapSnapshot(AS_CSTRING(args[0])));
+} 
+
 static void resetStack() {
     // move stack ptr all the way to the beginning
     vm.stackTop = vm.stack;
     vm.frameCount = 0;
-    vm.openUpvalues = NULL;
+    for(int slot = 0; slot < vm.openUpvalueEnd; slot++)
+        vm.openUpvalues[slot] = NULL;
+    vm.openUpvalueEnd = 0;
 } 
 
 // declaring our own variadic function!
@@ -116,14 +256,65 @@ static void defineNative(const char* name, NativeFn function) {
 
 void initVM() {
     resetStack();
-    vm.objects = NULL;
+    // before anything gets hashed
+    seedHash(randomHashSeed());
+    for(int sizeClass = 0; sizeClass < OBJECT_CLASS_COUNT; sizeClass++)
+        vm.spaces[sizeClass] = (ObjSpace) { NULL, NULL, NULL, NULL };
+    for(int sizeClass = 0; sizeClass < SIZE_CLASS_COUNT; sizeClass++)
+        vm.freeBuffers[sizeClass] = NULL;
+    vm.bufferPages = NULL;
+    vm.nursery = NULL;
+    vm.immortalAllocation = false;
+    vm.youngAllocation = false;
+    vm.immortalCode = false;
+    vm.mortalNames = false;
+    vm.immortalPages = NULL;
+    vm.immortalTop = NULL;
+    vm.immortalBytes = 0;
+    vm.frozenRootCount = 0;
+    vm.frozenRootCapacity = 0;
+    vm.frozenRoots = NULL;
+    vm.freezeRequested = false;
+    vm.scopeOpen = false;
+    vm.scopeEscaped = false;
+    vm.scopeGlobalBase = 0;
+    vm.scopeGlobals = NULL;
+    vm.arena = NULL;
     vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024; // magic number
+    memset(vm.objectsAllocated, 0, sizeof(vm.objectsAllocated));
+    vm.trackAllocations = false;
+    vm.sampleAllocations = false;
+    vm.gcRequested = false;
+    vm.gcTrigger = GC_TRIGGER_NURSERY;
+    vm.heapExhausted = false;
+    vm.refusedBytes = 0;
+    vm.systemOutOfMemory = false;
 
     // for GC
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.remembered = NULL;
+    vm.weakCount = 0;
+    vm.weakCapacity = 0;
+    vm.weakObjects = NULL;
+    vm.gcPhase = GC_IDLE;
+    vm.gcSliceBudget = GC_SLICE_BUDGET;
+    vm.gcCompactThreshold = GC_COMPACT_THRESHOLD;
+    vm.gcBytesCompacted = 0;
+    vm.markerActive = false;
+    vm.gcCycleStart = 0;
+    vm.gcPauses = 0;
+    vm.gcPauseTotal = 0;
+    vm.gcPauseMax = 0;
+    vm.gcCycleTrigger = GC_TRIGGER_HEAP;
+    vm.gcMarkTime = 0;
+    vm.gcSweepTime = 0;
+    memset(vm.gcFreedYoung, 0, sizeof(vm.gcFreedYoung));
+    memset(vm.gcFreedOld, 0, sizeof(vm.gcFreedOld));
+    configureGC(); // sets `nextGC` and `gcLogFd`
 
     // globals and constant globals
     initTable(&vm.globalNames);
@@ -132,6 +323,8 @@ void initVM() {
     // strings
     initTable(&vm.strings);
 
+    // these live as long as the VM does, like the main script's code
+    vm.immortalAllocation = true;
     vm.initString = NULL; // must zero out to prevent that
     vm.initString = copyString("init", 4); // might trigger a GC
 
@@ -141,6 +334,17 @@ void initVM() {
     defineNative("sqrt", sqrtNative);
     defineNative("inputLine", userInputNative);
     */
+    defineNative("weakRef", weakRefNative);
+    defineNative("deref", derefNative);
+    defineNative("weakTable", weakTableNative);
+    defineNative("weakGet", weakGetNative);
+    defineNative("weakHas", weakHasNative);
+    defineNative("weakSet", weakSetNative);
+    defineNative("weakDelete", weakDeleteNative);
+    defineNative("weakCount", weakCountNative);
+    defineNative("heapSnapshot", heapSnapshotNative);
+    defineNative("freeze", freezeNative);
+    vm.immortalAllocation = false;
 } 
 
 void freeVM() {
@@ -149,6 +353,8 @@ void freeVM() {
     freeValueArray(&vm.globalValues);
     freeTable(&vm.strings);
     vm.initString = NULL;
+    free(vm.scopeGlobals);
+    vm.scopeGlobals = NULL;
     freeObjects();
 } 
 
@@ -173,6 +379,37 @@ static Value peek(int distance) {
     return vm.stackTop[-1 - distance];
 } 
 
+// globals that were already defined when the request scope opened outlive it
+static inline bool isScopedGlobal(uint32_t index) {
+    return index >= (uint32_t) vm.scopeGlobalBase || vm.scopeGlobals[index];
+} 
+
+static inline void storeGlobal(uint32_t index, Value value) {
+    if(vm.scopeOpen) checkEscape(isScopedGlobal(index), value);
+    vm.globalValues.values[index] = value;
+} 
+
+// when `tryReallocate` turned something down, or there's nothing left after all
+static void heapError() {
+    if(vm.systemOutOfMemory) runtimeError("Out of memory.");
+    else runtimeError("Out of memory: the heap is over its limit of %zu bytes.", vm.gcMaxHeap);
+    vm.heapExhausted = false;
+    vm.systemOutOfMemory = false;
+    vm.refusedBytes = 0;
+} 
+
+// the last chance after `tryReallocate` turns something down, without waiting for the safepoint.
+// a collection moves objects, so only an instruction that still has everything
+// it needs on the stack can do this, and it has to read it all again afterwards.
+// false if that didn't make enough room (then it's a `heapError`)
+static bool collectToRetry() {
+    vm.gcRequested = true;
+    collectGarbage();
+    if(vm.heapExhausted) return false;
+    vm.systemOutOfMemory = false;
+    return true;
+} 
+
 static bool call(ObjClosure* closure, int argCount) {
     if(argCount != closure->function->arity) {
         runtimeError("Expected %d arguments but got %d in function '%s'.", 
@@ -227,6 +464,19 @@ static bool callValue(Value callee, int argCount) {
                 ObjNative* native = AS_NATIVE(callee);
                 bool wasError = false;
                 Value result = native->function(argCount, vm.stackTop - argCount, &wasError);
+                // it ran out of room: collect with its arguments still on the stack and try once more
+                if(wasError && (vm.refusedBytes > 0 || vm.systemOutOfMemory)) {
+                    if(!collectToRetry()) {
+                        heapError();
+                        return false;
+                    } 
+                    wasError = false;
+                    result = native->function(argCount, vm.stackTop - argCount, &wasError);
+                    if(wasError && (vm.refusedBytes > 0 || vm.systemOutOfMemory)) {
+                        heapError();
+                        return false;
+                    } 
+                } 
                 vm.stackTop -= argCount + 1;
                 if(wasError) {
                     runtimeError("%s", AS_CSTRING(result));
@@ -289,46 +539,39 @@ static bool bindMethod(ObjClass* klass, ObjString* name) {
     return true;
 } 
 
+// open upvalues are kept by the stack slot they point at,
+// so finding the one a closure should share is a lookup instead of a walk down a list
 static ObjUpvalue* captureUpvalue(Value* local) {
-    ObjUpvalue* prevUpvalue = NULL;
-
-    // start at head of list and traverse down
-    ObjUpvalue* upvalue = vm.openUpvalues;
-    while(upvalue != NULL && upvalue->location > local) {
-        prevUpvalue = upvalue;
-        upvalue = upvalue->next;
-    } 
-
-    // if we've landed on the actual upvalue
-    if(upvalue != NULL && upvalue->location == local)
-        return upvalue;
-
-    ObjUpvalue* createdUpvalue = newUpvalue(local);
-    createdUpvalue->next = upvalue;
-
-    // insert at head or after the previous
-    if(prevUpvalue == NULL)
-        vm.openUpvalues = createdUpvalue;
-    else
-        prevUpvalue->next = createdUpvalue;
-
-    return createdUpvalue;
+    int slot = (int) (local - vm.stack);
+    ObjUpvalue* upvalue = vm.openUpvalues[slot];
+    if(upvalue != NULL) return upvalue;
+
+    upvalue = newUpvalue(local);
+    vm.openUpvalues[slot] = upvalue;
+    if(slot >= vm.openUpvalueEnd) vm.openUpvalueEnd = slot + 1;
+    return upvalue;
 } 
 
-// closes all upvalues up to a certain point, `last`
+// closes all upvalues up to a certain point, `last`.
+// only the slots between it and `openUpvalueEnd` get looked at, so returning
+// from a function that captured nothing doesn't cost more than the comparison
 static void closeUpvalues(Value* last) {
-    while(vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-        // top of list
-        ObjUpvalue* upvalue = vm.openUpvalues;
+    int first = (int) (last - vm.stack);
+    for(int slot = first; slot < vm.openUpvalueEnd; slot++) {
+        ObjUpvalue* upvalue = vm.openUpvalues[slot];
+        if(upvalue == NULL) continue;
         // store it's value as the value of the variable
         // this is the heap location
+        writeBarrier((Obj*) upvalue, *upvalue->location);
+        lockHeap();
         upvalue->closed = *upvalue->location;
         // store it's location as that value's address
         // instead of pointing to the stack, it now points to its other field
         upvalue->location = &upvalue->closed;
-        // get rid of it
-        vm.openUpvalues = upvalue->next;
+        unlockHeap();
+        vm.openUpvalues[slot] = NULL;
     } 
+    if(first < vm.openUpvalueEnd) vm.openUpvalueEnd = first;
 } 
 
 // method closure is on top of stack from the `function` call in compiler
@@ -337,6 +580,8 @@ static void closeUpvalues(Value* last) {
 static void defineMethod(ObjString* name) {
     Value method = peek(0);
     ObjClass* klass = AS_CLASS(peek(1));
+    writeBarrier((Obj*) klass, OBJ_VAL(name));
+    writeBarrier((Obj*) klass, method);
     tableSet(&klass->methods, name, method);
     pop();
 } 
@@ -346,9 +591,38 @@ static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 } 
 
-static void concatenate() {
+// for an instruction that can back out: if the buffer would take the heap over its limit,
+// collect right here and try again. NULL (after a `heapError`) if there's still no room
+static char* allocateOrCollect(size_t size) {
+    char* chars = TRY_ALLOCATE(char, size);
+    if(chars == NULL && collectToRetry()) chars = TRY_ALLOCATE(char, size);
+    if(chars == NULL) heapError();
+    return chars;
+} 
+
+// `==` on two strings of the same length compares their characters,
+// and a rope's have to be joined first
+static bool flattenOperands() {
+    if(!IS_STRING(peek(0)) || !IS_STRING(peek(1))) return true;
+    for(int attempt = 0; attempt < 2; attempt++) {
+        ObjString* b = AS_STRING(peek(0));
+        ObjString* a = AS_STRING(peek(1));
+        if(a == b || a->length != b->length) return true;
+        if(tryFlattenString(a) && tryFlattenString(b)) return true;
+        if(attempt == 0 && !collectToRetry()) break;
+    } 
+    heapError();
+    return false;
+} 
+
+static bool concatenate() {
     ObjString* b = AS_STRING(peek(0));
     ObjString* a = AS_STRING(peek(1));
+    // a rope makes doubling a string cheap, so this is only a few `s = s + s` away
+    if(a->length > INT_MAX - b->length) {
+        runtimeError("String too long.");
+        return false;
+    } 
 
     // this works if the string is always new...
     // but no good if it already does.
@@ -362,22 +636,34 @@ static void concatenate() {
 
     // dynamically make new string
     int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length+1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    ObjString* result;
+    if(length >= ROPE_MIN_LENGTH) {
+        // long strings just remember their halves, so building a string
+        // in a loop doesn't copy everything built so far on every `+`
+        result = newRope(a, b);
+    } else {
+        char* chars = allocateOrCollect(length + 1);
+        if(chars == NULL) return false;
+        // that might have collected, and moved them
+        b = AS_STRING(peek(0));
+        a = AS_STRING(peek(1));
+        memcpy(chars, a->chars, a->length);
+        memcpy(chars + a->length, b->chars, b->length);
+        chars[length] = '\0';
 
-    /*
-    // have to use copyString, because of the ways strings are stored
-    ObjString* result = copyString(chars, length);
-    */
+        /*
+        // have to use copyString, because of the ways strings are stored
+        ObjString* result = copyString(chars, length);
+        */
 
-    // use `takeString` here because the chars are already dynamically allocated
-    // no need to copy them
-    ObjString* result = takeString(chars, length);
+        // use `takeString` here because the chars are already dynamically allocated
+        // no need to copy them
+        result = takeString(chars, length);
+    } 
     pop();
     pop();
     push(OBJ_VAL(result));
+    return true;
 } 
 
 // the heart and soul of the virtual machine
@@ -406,6 +692,15 @@ static InterpretResult run() {
     } while(false)
 
     for(;;) {
+        // the only place the garbage collector runs
+        if(vm.gcRequested) {
+            collectGarbage();
+            if(vm.heapExhausted || vm.systemOutOfMemory) {
+                heapError();
+                return INTERPRET_RUNTIME_ERROR;
+            } 
+        } 
+
 #ifdef DEBUG_TRACE_EXECUTION
         printf("         ");
         for(Value* slot = vm.stack; slot < vm.stackTop; slot++) {
@@ -442,6 +737,7 @@ static InterpretResult run() {
             case OP_TRUE: push(BOOL_VAL(true)); break;
             case OP_FALSE: push(BOOL_VAL(false)); break;
             case OP_EQUAL: {
+                if(!flattenOperands()) return INTERPRET_RUNTIME_ERROR;
                 Value b = pop();
                 Value a = pop();
                 push(BOOL_VAL(valuesEqual(a, b)));
@@ -460,9 +756,9 @@ static InterpretResult run() {
                 push(NUMBER_VAL(-AS_NUMBER(pop()))); break;
                 // vm.stackTop[-1] = NUMBER_VAL(-AS_NUMBER(vm.stackTop[-1])); break;
             case OP_ADD: {
-                if(IS_STRING(peek(0)) && IS_STRING(peek(1)))
-                    concatenate();
-                else if(IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                if(IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                    if(!concatenate()) return INTERPRET_RUNTIME_ERROR;
+                } else if(IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
                     double b = AS_NUMBER(pop());
                     double a = AS_NUMBER(pop());
                     push(NUMBER_VAL(a + b));
@@ -501,14 +797,18 @@ static InterpretResult run() {
                 break;
             } 
             case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
+                ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+                writeBarrier((Obj*) upvalue, peek(0));
+                lockHeap();
+                snapshotBarrier(*upvalue->location);
+                *upvalue->location = peek(0);
+                unlockHeap();
                 break;
             } 
             case OP_DEFINE_GLOBAL: {
                 // take index off of chunk
                 // this represents some global variable
-                vm.globalValues.values[READ_BYTE()] = peek(0);
+                storeGlobal(READ_BYTE(), peek(0));
                 pop();
                 /*
                 ObjString* name = READ_STRING();
@@ -518,7 +818,7 @@ static InterpretResult run() {
                 break;
             } 
             case OP_DEFINE_GLOBAL_LONG: {
-                vm.globalValues.values[READ_LONG_BYTE()] = peek(0);
+                storeGlobal(READ_LONG_BYTE(), peek(0));
                 pop();
             /*
                 ObjString* name = READ_LONG_STRING();
@@ -575,7 +875,7 @@ static InterpretResult run() {
                     else runtimeError("Trying to set undefined variable '%s'.", key->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 } 
-                vm.globalValues.values[index] = peek(0);
+                storeGlobal(index, peek(0));
             /*
                 ObjString* name = READ_STRING();
                 // tableSet returns `true` if it is NEW thing being added
@@ -597,7 +897,7 @@ static InterpretResult run() {
                     else runtimeError("Trying to set undefined variable '%s'.", key->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 } 
-                vm.globalValues.values[index] = peek(0);
+                storeGlobal(index, peek(0));
                 /*
                 ObjString* name = READ_LONG_STRING();
                 // tableSet returns `true` if it is NEW thing being added
@@ -653,6 +953,32 @@ static InterpretResult run() {
                 runtimeError("Undefine property '%s'.", name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             } 
+            // OP_GET_PROPERTY for a property that's called right away (see `call` in the compiler).
+            // a method leaves itself and then the receiver, a field leaves nil and then its value,
+            // for OP_CALL_METHOD to call without making a bound method
+            case OP_GET_METHOD: {
+                if(!IS_INSTANCE(peek(0))) {
+                    runtimeError("Only instances have properties.");
+                    return INTERPRET_RUNTIME_ERROR;
+                } 
+
+                ObjInstance* instance = AS_INSTANCE(peek(0));
+                ObjString* name = READ_STRING();
+                Value value;
+
+                if(tableGet(&instance->fields, name, &value)) {
+                    vm.stackTop[-1] = NIL_VAL;
+                    push(value);
+                    break;
+                } 
+                if(!tableGet(&instance->klass->methods, name, &value)) {
+                    runtimeError("Undefined property '%s'.", name->chars);
+                    return INTERPRET_RUNTIME_ERROR;
+                } 
+                vm.stackTop[-1] = value;
+                push(OBJ_VAL(instance));
+                break;
+            } 
             case OP_SET_PROPERTY: {
                 if(!IS_INSTANCE(peek(1))) {
                     runtimeError("Only instances have fields to set.");
@@ -660,7 +986,10 @@ static InterpretResult run() {
                 } 
                 // stack is currently [ instance ][ Value ]
                 ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
+                ObjString* name = READ_STRING();
+                writeBarrier((Obj*) instance, OBJ_VAL(name));
+                writeBarrier((Obj*) instance, peek(0));
+                tableSet(&instance->fields, name, peek(0));
                 Value value = pop();
                 pop();
                 push(value);
@@ -673,7 +1002,10 @@ static InterpretResult run() {
                 } 
                 // stack is currently [ instance ][ Value ]
                 ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_LONG_STRING(), peek(0));
+                ObjString* name = READ_LONG_STRING();
+                writeBarrier((Obj*) instance, OBJ_VAL(name));
+                writeBarrier((Obj*) instance, peek(0));
+                tableSet(&instance->fields, name, peek(0));
                 Value value = pop();
                 pop();
                 push(value);
@@ -942,6 +1274,19 @@ static InterpretResult run() {
                 frame = &vm.frames[vm.frameCount - 1];
                 break;
             } 
+            case OP_CALL_METHOD: {
+                int argCount = READ_BYTE();
+                // take out what's under the callee, so the stack looks like an OP_CALL's
+                Value* callee = vm.stackTop - argCount - 1;
+                Value method = callee[-1];
+                memmove(callee - 1, callee, sizeof(Value) * (argCount + 1));
+                vm.stackTop--;
+                bool called = IS_NIL(method) ? callValue(peek(argCount), argCount)
+                                             : call(AS_CLOSURE(method), argCount);
+                if(!called) return INTERPRET_RUNTIME_ERROR;
+                frame = &vm.frames[vm.frameCount - 1];
+                break;
+            } 
             case OP_INVOKE: {
                 ObjString* method = READ_STRING();
                 int argCount = READ_BYTE();
@@ -987,6 +1332,11 @@ static InterpretResult run() {
             } 
             case OP_CLOSURE: {
                 ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+                // nothing to capture: it's the same closure every time
+                if(function->closure != NULL) {
+                    push(OBJ_VAL(function->closure));
+                    break;
+                } 
                 ObjClosure* closure = newClosure(function);
                 push(OBJ_VAL(closure));
 
@@ -1005,6 +1355,11 @@ static InterpretResult run() {
             } 
             case OP_CLOSURE_LONG: {
                 ObjFunction* function = AS_FUNCTION(READ_LONG_CONSTANT());
+                // nothing to capture: it's the same closure every time
+                if(function->closure != NULL) {
+                    push(OBJ_VAL(function->closure));
+                    break;
+                } 
                 ObjClosure* closure = newClosure(function);
                 push(OBJ_VAL(closure));
 
@@ -1063,6 +1418,7 @@ static InterpretResult run() {
 
                 // simply copies down the methods.
                 // overrides will happen when those are compiled, later
+                writeBarrierAll((Obj*) subclass);
                 tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
                 pop(); // pop off subclass
                 break;
@@ -1085,15 +1441,58 @@ static InterpretResult run() {
 #undef BINARY_OP
 } 
 
+// for running one short script after another, like one per request in a server.
+// everything allocated between these two (compiled code included) goes into an arena,
+// which is thrown away in one go at the end instead of being traced and swept,
+// and the globals the request declared are undefined again.
+// objects that were stored into something older than the scope (an older global,
+// or the fields of an older object) are kept, see `releaseArena`.
+// call them between `interpret`s; scopes don't nest
+void beginRequestScope() {
+    if(vm.scopeOpen) return;
+    vm.scopeOpen = true;
+    vm.scopeEscaped = false;
+    vm.scopeGlobalBase = vm.globalValues.count;
+    // an earlier request's globals have been undefined again, and are this one's now
+    vm.scopeGlobals = (bool*) realloc(vm.scopeGlobals, sizeof(bool) * (vm.scopeGlobalBase + 1));
+    if(vm.scopeGlobals == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    } 
+    for(int i = 0; i < vm.scopeGlobalBase; i++)
+        vm.scopeGlobals[i] = IS_UNDEF(vm.globalValues.values[i]);
+} 
+
+void endRequestScope() {
+    if(!vm.scopeOpen) return;
+    for(int i = 0; i < vm.globalValues.count; i++) {
+        if(isScopedGlobal(i)) vm.globalValues.values[i] = UNDEF_VAL;
+    } 
+    vm.scopeOpen = false;
+    releaseArena(vm.scopeEscaped);
+} 
+
+// for a process that loads its scripts once and then forks off workers.
+// everything alive right now is moved into the immortal region: it is never marked,
+// swept or moved again, so a worker's collections only look at what it made itself,
+// and it only writes to pages of its own (see `freezeObjects`), which keeps
+// the pages it shares with its parent shared.
+// a frozen object can still be changed; it then becomes a root of every collection
+// (see `rememberFrozen`), so only those few get looked at.
+// call it between `interpret`s (or with `freeze()`), and not inside a request scope
+bool freezeHeap() {
+    if(vm.scopeOpen) return false;
+    freezeObjects();
+    return true;
+} 
+
 InterpretResult interpret(const char* source) {
     ObjFunction* function = compile(source);
     if(function == NULL) return INTERPRET_COMPILE_ERROR;
 
-    // this weird push-pop-push behavior is for the garbage collector
-    push(OBJ_VAL(function)); // reserved for VM
-    ObjClosure* closure = newClosure(function);
-    pop();
-    push(OBJ_VAL(closure));
+    // a script never captures anything, so it already has its closure
+    ObjClosure* closure = function->closure;
+    push(OBJ_VAL(closure)); // reserved for VM
     call(closure, 0);
 
     //execute the vm
@@ -19,6 +19,42 @@ typedef struct {
     Value* slots;
 } CallFrame;
 
+// see memory.c
+typedef struct NurseryChunk NurseryChunk;
+typedef struct Page Page;
+
+// allocations up to this size come out of slabs, in size classes 8 bytes apart
+#define SLAB_MAX 256
+#define SIZE_CLASS_COUNT (SLAB_MAX / 8)
+// old objects have slabs of their own, and go up to a closure with as many upvalues as it can have
+#define OBJECT_MAX (sizeof(ObjClosure) + sizeof(ObjUpvalue*) * UINT8_COUNT)
+#define OBJECT_CLASS_COUNT ((int) (OBJECT_MAX / 8))
+
+// the old objects of one size class
+typedef struct {
+    Page* pages;
+    Page* lastPage;
+    Page* allocPage; // the first page that might have a free cell
+    Page* sweepPage; // the next page the sweep increments will look at
+} ObjSpace;
+
+// where the major collection of the old generation is at
+typedef enum {
+    GC_IDLE,
+    GC_MARKING,
+    GC_SWEEPING,
+} GCPhase;
+
+// why a collection was asked for, for the event log (see gclog.h)
+typedef enum {
+    GC_TRIGGER_NURSERY, // a nursery chunk filled up
+    GC_TRIGGER_HEAP, // the heap grew past `nextGC`
+    GC_TRIGGER_STRESS, // DEBUG_STRESS_GC
+    GC_TRIGGER_SCOPE, // a request scope escaped
+    GC_TRIGGER_LIMIT, // over `gcMaxHeap`
+    GC_TRIGGER_FREEZE, // `freeze()` (see `freezeHeap`)
+} GCTrigger;
+
 typedef struct {
     CallFrame frames[FRAMES_MAX];
     int frameCount;
@@ -29,15 +65,89 @@ typedef struct {
 	ValueArray globalValues;
 	Table strings;
     ObjString* initString; // for speed
-    ObjUpvalue* openUpvalues;
+    // the open upvalue pointing at each stack slot, if there is one (see `captureUpvalue`)
+    ObjUpvalue* openUpvalues[STACK_MAX];
+    int openUpvalueEnd; // no slot from here up has one
 
     size_t bytesAllocated;
+    size_t objectsAllocated[OBJ_TYPE_COUNT]; // by type, for the memory report in bench/
+    bool trackAllocations; // remember where each object was allocated, for heap snapshots
+    bool sampleAllocations; // the allocation profiler is on (see profile.c)
     size_t nextGC;
-	Obj* objects;
+    bool gcRequested; // checked at the top of every instruction
+    GCTrigger gcTrigger; // what asked for it
+    bool heapExhausted; // still over `gcMaxHeap` after a full collection
+    size_t refusedBytes; // turned down by `tryReallocate` since the last collection
+    bool systemOutOfMemory; // `tryReallocate` couldn't get memory from the system
+    ObjSpace spaces[OBJECT_CLASS_COUNT]; // the old generation
+    NurseryChunk* nursery; // the young one
+    // small buffers (string characters, tables, ...)
+    void* freeBuffers[SIZE_CLASS_COUNT];
+    Page* bufferPages;
+    // the main script's code, which is never collected (see `allocateImmortal`)
+    bool immortalAllocation; // new objects go here instead of the nursery
+    bool youngAllocation; // or in the nursery even if a request scope is open
+    bool immortalCode; // the next `compile` allocates immortally (see `runFile`)
+    bool mortalNames; // some of `vm.globalNames` might be collected, so it's a root
+    Page* immortalPages;
+    char* immortalTop; // where the next one goes, in the first page
+    size_t immortalBytes;
+    // frozen objects (see `freezeHeap`) that have been written since,
+    // and might point out of the immortal region
+    int frozenRootCount;
+    int frozenRootCapacity;
+    Obj** frozenRoots;
+    bool freezeRequested; // `freeze()` was called: it happens at the next safepoint
+    // the open request scope, if any (see `beginRequestScope`)
+    bool scopeOpen;
+    bool scopeEscaped; // one of its objects was stored somewhere that outlives it
+    // the globals that were still undefined when it opened belong to it,
+    // as do any declared after `scopeGlobalBase`
+    int scopeGlobalBase;
+    bool* scopeGlobals;
+    NurseryChunk* arena; // where its objects go
     // for the garbage collector
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
+    // old objects that might point at young ones
+    int rememberedCount;
+    int rememberedCapacity;
+    Obj** remembered;
+    // weak references and tables marked this cycle
+    int weakCount;
+    int weakCapacity;
+    Obj** weakObjects;
+    // major collections happen in increments
+    GCPhase gcPhase;
+    int gcSliceBudget;
+    bool markerActive; // the background marker thread is running (GC_CONCURRENT)
+    size_t gcCycleStart; // heap size when the cycle began
+    double gcCycleTime; // seconds spent marking and sweeping in this cycle
+    size_t gcCycleFreed; // bytes swept in this cycle
+    size_t gcCycleWork; // roughly how many objects and cells this cycle has to get through
+    size_t gcLastSlice; // heap size at the last increment
+    double gcLastCycleEnd;
+    GCTrigger gcCycleTrigger; // what started this cycle
+    double gcMarkTime; // this cycle's share of `gcCycleTime`, on this thread
+    double gcSweepTime;
+    // objects freed, by type: young ones since the last pause that was logged,
+    // old ones since the cycle started
+    size_t gcFreedYoung[OBJ_TYPE_COUNT];
+    size_t gcFreedOld[OBJ_TYPE_COUNT];
+    int gcLogFd; // where the event log goes, or -1 (see gclog.h)
+    // settings (see `configureGC`)
+    size_t gcInitialHeap;
+    double gcGrowFactor;
+    size_t gcMaxHeap; // a hard limit: going over it is a runtime error
+    double gcTargetPause; // in seconds
+    double gcGrowth; // `gcGrowFactor`, as adapted to how the program behaves
+    int gcCompactThreshold;
+    size_t gcBytesCompacted; // pages given back by compaction, in total
+    // pause times, in seconds
+    int gcPauses;
+    double gcPauseTotal;
+    double gcPauseMax;
 } VM;
 
 typedef enum {
@@ -52,6 +162,9 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source);
+void beginRequestScope();
+void endRequestScope();
+bool freezeHeap();
 void push(Value value);
 Value pop();
 
@@ -0,0 +1,130 @@
+#include <stdint.h>
+
+#include "hash.h"
+#include "memory.h"
+#include "weak.h"
+
+// the tables behind `weakTable()`.
+// unlike `Table`, any value but nil can be a key, compared the way `==` compares.
+// what makes them weak is all in the garbage collector (see `clearWeakReferences`):
+// this is a plain open-addressing table, with tombstones for deletions
+
+#define WEAK_TABLE_MAX_LOAD 0.75
+
+// strings are compared by content, so the key is always the interned copy.
+// this can allocate
+static Value internKey(Value key) {
+    if(IS_STRING(key)) return OBJ_VAL(internString(AS_STRING(key)));
+    return key;
+} 
+
+// objects hash by address, so a table has to be rehashed
+// whenever the garbage collector moves one of its keys
+static uint32_t hashKey(Value key) {
+    if(IS_STRING(key)) return AS_STRING(key)->hash;
+    if(IS_OBJ(key)) {
+        uint64_t address = (uint64_t) (uintptr_t) AS_OBJ(key);
+        return (uint32_t) ((address >> 3) ^ (address >> 32)) * 2654435761u;
+    } 
+    if(IS_NUMBER(key)) {
+        double number = AS_NUMBER(key);
+        if(number == 0) number = 0; // -0 == 0
+        return hashString((const char*) &number, sizeof(number));
+    } 
+    return IS_BOOL(key) && AS_BOOL(key) ? 1 : 2;
+} 
+
+static WeakEntry* findEntry(WeakEntry* entries, int capacity, Value key) {
+    uint32_t index = hashKey(key) & (capacity - 1);
+    WeakEntry* tombstone = NULL;
+    for(;;) {
+        WeakEntry* entry = &entries[index];
+        if(IS_NIL(entry->key)) {
+            if(IS_NIL(entry->value)) return tombstone != NULL ? tombstone : entry;
+            if(tombstone == NULL) tombstone = entry;
+        } else if(valuesEqual(entry->key, key)) {
+            return entry;
+        } 
+        index = (index + 1) & (capacity - 1);
+    } 
+} 
+
+// false if growing was turned down for going over the heap limit (see `tryReallocate`)
+static bool adjustCapacity(ObjWeakTable* table, int capacity, bool canFail) {
+    WeakEntry* entries = canFail ? TRY_ALLOCATE(WeakEntry, capacity) : ALLOCATE(WeakEntry, capacity);
+    if(entries == NULL) return false;
+    for(int i = 0; i < capacity; i++) {
+        entries[i].key = NIL_VAL;
+        entries[i].value = NIL_VAL;
+    } 
+
+    // tombstones don't make it over
+    for(int i = 0; i < table->capacity; i++) {
+        WeakEntry* entry = &table->entries[i];
+        if(IS_NIL(entry->key)) continue;
+        WeakEntry* dest = findEntry(entries, capacity, entry->key);
+        dest->key = entry->key;
+        dest->value = entry->value;
+    } 
+    table->tombstones = 0;
+
+    FREE_ARRAY(WeakEntry, table->entries, table->capacity);
+    table->entries = entries;
+    table->capacity = capacity;
+    return true;
+} 
+
+bool weakTableGet(ObjWeakTable* table, Value key, Value* value) {
+    if(table->count == 0) return false;
+    WeakEntry* entry = findEntry(table->entries, table->capacity, internKey(key));
+    if(IS_NIL(entry->key)) return false;
+    *value = entry->value;
+    return true;
+} 
+
+void weakTableSet(ObjWeakTable* table, Value key, Value value) {
+    key = internKey(key);
+    writeBarrier((Obj*) table, key);
+    writeBarrier((Obj*) table, value);
+
+    lockHeap();
+    if(table->count + table->tombstones + 1 > table->capacity * WEAK_TABLE_MAX_LOAD &&
+            !adjustCapacity(table, GROW_CAPACITY(table->capacity), true)) {
+        // fill it past the load factor until the next safepoint's collection,
+        // but always leave an empty slot to stop probes
+        if(table->count + table->tombstones + 2 > table->capacity)
+            adjustCapacity(table, GROW_CAPACITY(table->capacity), false);
+    } 
+    WeakEntry* entry = findEntry(table->entries, table->capacity, key);
+    if(IS_NIL(entry->key)) {
+        if(!IS_NIL(entry->value)) table->tombstones--;
+        table->count++;
+        entry->key = key;
+    } else {
+        snapshotBarrier(entry->value);
+    } 
+    entry->value = value;
+    unlockHeap();
+} 
+
+bool weakTableDelete(ObjWeakTable* table, Value key) {
+    if(table->count == 0) return false;
+    WeakEntry* entry = findEntry(table->entries, table->capacity, internKey(key));
+    if(IS_NIL(entry->key)) return false;
+
+    lockHeap();
+    snapshotBarrier(entry->key);
+    snapshotBarrier(entry->value);
+    entry->key = NIL_VAL;
+    entry->value = BOOL_VAL(true); // tombstone
+    table->count--;
+    table->tombstones++;
+    unlockHeap();
+    return true;
+} 
+
+// for the garbage collector, once it has moved some of the keys.
+// the heap is already locked
+void weakTableRehash(ObjWeakTable* table) {
+    if(table->capacity > 0) adjustCapacity(table, table->capacity, false);
+} 
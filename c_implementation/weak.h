@@ -0,0 +1,13 @@
+#ifndef clox_weak_h
+#define clox_weak_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+bool weakTableGet(ObjWeakTable* table, Value key, Value* value);
+void weakTableSet(ObjWeakTable* table, Value key, Value value);
+bool weakTableDelete(ObjWeakTable* table, Value key);
+void weakTableRehash(ObjWeakTable* table);
+
+#endif